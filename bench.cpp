@@ -0,0 +1,241 @@
+// Benchmark harness for matrix_ops (built and run by 'make bench').            //
+// Generates random input files for a range of sizes and densities, then        //
+// times loadMatrices, add, multiply, the diagonal sums, the swaps,             //
+// updateCell and printMatrix. For each operation it reports latency            //
+// percentiles, a GFLOP/s-equivalent (work units per second, where work is      //
+// two per multiply-add the product performs - 2N^3 when both operands are      //
+// dense - and the number of values touched otherwise) and the heap             //
+// allocations per call, as CSV (default) or JSON.                              //
+//                                                                              //
+// Usage: matrix_ops_bench [--sizes 64,256,1024] [--densities 1,0.01]           //
+// [--reps 7] [--threads N] [--seed S] [--format csv|json] [--out FILE]         //
+#define MATRIX_OPS_NO_MAIN               // Reuse everything in main.cpp except main().
+#include "main.cpp"                      // The code being measured.
+#include <random>                        // Provides std::mt19937_64 for the generated matrices.
+#include <cstdio>                        // Provides std::remove for the temporary input file.
+#include <cmath>                         // Provides std::ceil for percentile ranks.
+
+// ---- Allocation counting --------------------------------------------------  //
+// Every global operator new is replaced so the harness can report how many     //
+// heap allocations (and bytes) each operation makes.                           //
+static atomic<u64> allocCount{0}, allocBytes{0};                                // Totals since start.
+
+static void* countedAlloc(size_t n, size_t align) {                             // Shared by all the variants.
+    allocCount.fetch_add(1, memory_order_relaxed);                              // One more allocation,
+    allocBytes.fetch_add(n, memory_order_relaxed);                              // of n bytes.
+    void* p = nullptr;                                                          // Result.
+    if (posix_memalign(&p, max(align, sizeof(void*)), n ? n : 1) != 0) throw bad_alloc(); // free() releases both kinds.
+    return p;                                                                   // ...
+}
+void* operator new(size_t n) { return countedAlloc(n, alignof(max_align_t)); }  // Plain new.
+void* operator new[](size_t n) { return countedAlloc(n, alignof(max_align_t)); } // Array new.
+void* operator new(size_t n, align_val_t a) { return countedAlloc(n, (size_t)a); } // Over-aligned new (Matrix rows).
+void* operator new[](size_t n, align_val_t a) { return countedAlloc(n, (size_t)a); } // ...
+void operator delete(void* p) noexcept { free(p); }                             // Matching deletes.
+void operator delete[](void* p) noexcept { free(p); }                           // ...
+void operator delete(void* p, size_t) noexcept { free(p); }                     // ...
+void operator delete[](void* p, size_t) noexcept { free(p); }                   // ...
+void operator delete(void* p, align_val_t) noexcept { free(p); }                // ...
+void operator delete[](void* p, align_val_t) noexcept { free(p); }              // ...
+void operator delete(void* p, size_t, align_val_t) noexcept { free(p); }        // ...
+void operator delete[](void* p, size_t, align_val_t) noexcept { free(p); }      // ...
+
+// ---- Measurement ----------------------------------------------------------  //
+// A stream that discards everything, so printMatrix is timed without I/O.      //
+class NullBuffer : public streambuf {                                           // Accepts and drops all output.
+protected:                                                                      // streambuf hooks.
+    int overflow(int c) override { return c; }                                  // One character.
+    streamsize xsputn(const char*, streamsize n) override { return n; }         // A block.
+};
+
+struct Result {                                                                 // One line of the report.
+    string op;                                                                  // Operation name.
+    int n;                                                                      // Matrix dimension.
+    double density;                                                             // Fraction of nonzero inputs.
+    vector<double> ms;                                                          // Per-call times, sorted.
+    double work;                                                                // Work units per call.
+    double allocs, bytes;                                                       // Heap use per call.
+
+    double pct(double p) const {                                                // Nearest-rank percentile.
+        size_t k = (size_t)ceil(p * ms.size());                                 // Rank (1-based).
+        return ms[min(ms.size(), max<size_t>(k, 1)) - 1];                       // ...
+    }
+    double mean() const {                                                       // Average time.
+        double s = 0;                                                           // ...
+        for (double v : ms) s += v;                                             // ...
+        return s / ms.size();                                                   // ...
+    }
+    double gflops() const { return work / (pct(0.5) * 1e-3) / 1e9; }            // At the median time.
+};
+
+// Times 'body' 'reps' times after one warm-up call. Operations faster than     //
+// 1 ms are repeated inside each sample so the clock resolution is no issue.    //
+static Result measure(const string& op, int n, double density, int reps, double work, // One operation.
+                      const function<void()>& body) {                           // ...
+    using clk = chrono::steady_clock;                                           // Monotonic clock.
+    auto t0 = clk::now();                                                       // Warm-up (also fills caches,
+    body();                                                                     // faults in buffers, etc.).
+    double once = chrono::duration<double>(clk::now() - t0).count();            // Rough cost of one call.
+    int inner = (int)min(1e6, max(1.0, 1e-3 / max(once, 1e-9)));                // Calls per sample.
+    Result r{op, n, density, {}, work, 0, 0};                                   // Filled below.
+    u64 c0 = allocCount.load(), b0 = allocBytes.load();                         // Heap use before.
+    for (int k = 0; k < reps; k++) {                                            // Samples.
+        auto s = clk::now();                                                    // ...
+        for (int i = 0; i < inner; i++) body();                                 // ...
+        r.ms.push_back(chrono::duration<double, milli>(clk::now() - s).count() / inner); // Time per call.
+    }
+    double calls = (double)reps * inner;                                        // Calls measured.
+    r.allocs = (allocCount.load() - c0) / calls;                                // Per call.
+    r.bytes = (allocBytes.load() - b0) / calls;                                 // ...
+    sort(r.ms.begin(), r.ms.end());                                             // For the percentiles.
+    return r;                                                                   // ...
+}
+
+// Writes N and two random NN matrices; each value is nonzero with             //
+// probability 'density'.                                                       //
+static bool writeInput(const string& path, int n, double density, mt19937_64& rng) { // Same format as sample_input.txt.
+    ofstream out(path);                                                         // Truncate.
+    if (!out) return false;                                                     // Could not create it.
+    uniform_real_distribution<double> coin(0.0, 1.0);                           // Nonzero or not.
+    uniform_int_distribution<int> value(1, 99);                                 // Magnitude.
+    out << n << '\n';                                                           // Dimension.
+    string line;                                                                // One row at a time.
+    for (int m = 0; m < 2; m++)                                                 // A, then B.
+        for (int i = 0; i < n; i++) {                                           // Each row.
+            line.clear();                                                       // ...
+            for (int j = 0; j < n; j++) {                                       // Each value.
+                int v = coin(rng) < density ? value(rng) * (rng() & 1 ? 1 : -1) : 0; // ...
+                line += to_string(v);                                           // ...
+                line += j + 1 < n ? ' ' : '\n';                                 // ...
+            }
+            out << line;                                                        // ...
+        }
+    return (bool)out;                                                           // False if a write failed.
+}
+
+// Work units of A * B: two per multiply-add the kernels perform. The CSR       //
+// kernels only visit stored entries, so crediting them with 2N^3 would         //
+// report far more than the machine can do.                                     //
+static double multiplyWork(const Matrix& A, const Matrix& B, int N) {           // Matches multiply()'s dispatch.
+    if (!A.isSparse() && !B.isSparse()) return 2.0 * N * N * N;                 // Classic count, also for Strassen.
+    if (!A.isSparse()) return 2.0 * B.nnz() * N;                                // Dense  sparse: N rows of A.
+    if (!B.isSparse()) return 2.0 * A.nnz() * N;                                // Sparse  dense: full rows of B.
+    double fma = 0;                                                             // Gustavson: each A(i,k) meets
+    for (int i = 0; i < N; i++) {                                               // every entry of row k of B.
+        const int* c = A.rowCols(i);                                            // ...
+        for (int x = 0, e = A.rowNnz(i); x < e; x++) fma += B.rowNnz(c[x]);     // ...
+    }
+    return 2 * fma;                                                             // ...
+}
+
+// Parses "a,b,c" into numbers.                                                 //
+template <class T>                                                              // int or double.
+static bool parseList(const string& s, vector<T>& out) {                        // For --sizes and --densities.
+    out.clear();                                                                // Replace the defaults.
+    istringstream in(s);                                                        // ...
+    string item;                                                                // ...
+    while (getline(in, item, ',')) {                                            // Each comma-separated item.
+        istringstream one(item);                                                // ...
+        T v;                                                                    // ...
+        if (!(one >> v) || !(one >> ws).eof()) return false;                    // Must be a whole number.
+        out.push_back(v);                                                       // ...
+    }
+    return !out.empty();                                                        // At least one value.
+}
+
+static void writeCsvReport(ostream& os, const vector<Result>& rs) {             // --format csv
+    os << "op,n,density,reps,min_ms,p50_ms,p90_ms,p99_ms,max_ms,mean_ms,gflops_equiv,allocs_per_call,bytes_per_call\n"; // Header.
+    for (const Result& r : rs)                                                  // One line per operation.
+        os << r.op << ',' << r.n << ',' << r.density << ',' << r.ms.size() << ',' << r.ms.front() << ',' // ...
+           << r.pct(0.5) << ',' << r.pct(0.9) << ',' << r.pct(0.99) << ',' << r.ms.back() << ',' // ...
+           << r.mean() << ',' << r.gflops() << ',' << r.allocs << ',' << r.bytes << '\n'; // ...
+}
+
+static void writeJsonReport(ostream& os, const vector<Result>& rs) {            // --format json
+    os << "[\n";                                                                // One array of objects.
+    for (size_t k = 0; k < rs.size(); k++) {                                    // ...
+        const Result& r = rs[k];                                                // ...
+        os << "  {\"op\": \"" << r.op << "\", \"n\": " << r.n << ", \"density\": " << r.density // ...
+           << ", \"reps\": " << r.ms.size() << ", \"min_ms\": " << r.ms.front() // ...
+           << ", \"p50_ms\": " << r.pct(0.5) << ", \"p90_ms\": " << r.pct(0.9)  // ...
+           << ", \"p99_ms\": " << r.pct(0.99) << ", \"max_ms\": " << r.ms.back() // ...
+           << ", \"mean_ms\": " << r.mean() << ", \"gflops_equiv\": " << r.gflops() // ...
+           << ", \"allocs_per_call\": " << r.allocs << ", \"bytes_per_call\": " << r.bytes << "}" // ...
+           << (k + 1 < rs.size() ? ",\n" : "\n");                               // ...
+    }
+    os << "]\n";                                                                // ...
+}
+
+int main(int argc, char** argv) {                                               // Harness entry point.
+    vector<int> sizes = {64, 256, 1024};                                        // Defaults.
+    vector<double> densities = {1.0, 0.01};                                     // Dense and sparse inputs.
+    int reps = 7, threads = (int)thread::hardware_concurrency();                // ...
+    u64 seed = 1;                                                               // Same matrices every run.
+    string format = "csv", outPath;                                             // Report to stdout by default.
+    for (int i = 1; i < argc; i++) {                                            // Scan command-line arguments.
+        string arg = argv[i];                                                   // Current argument.
+        string val = i + 1 < argc ? argv[i + 1] : "";                           // Its value, if any.
+        bool ok = i + 1 < argc;                                                 // Every option takes a value.
+        if (arg == "--sizes") ok = ok && parseList(val, sizes);                 // ...
+        else if (arg == "--densities") ok = ok && parseList(val, densities);    // ...
+        else if (arg == "--reps") ok = ok && parseInt(val, reps) && reps > 0;   // ...
+        else if (arg == "--threads") ok = ok && parseInt(val, threads) && threads > 0; // ...
+        else if (arg == "--seed") ok = ok && (istringstream(val) >> seed);      // ...
+        else if (arg == "--format") { format = val; ok = ok && (val == "csv" || val == "json"); } // ...
+        else if (arg == "--out") outPath = val;                                 // ...
+        else ok = false;                                                        // Unknown option.
+        if (!ok) {                                                              // ...
+            cerr << "Invalid argument '" << arg << "'.\n";                      // Name it.
+            return 1;                                                           // Exit with error.
+        }
+        i++;                                                                    // Skip the value.
+    }
+    for (int n : sizes)                                                         // Validate the lists.
+        if (n <= 0) { cerr << "Invalid size.\n"; return 1; }                    // ...
+    for (double d : densities)                                                  // ...
+        if (d < 0 || d > 1) { cerr << "Invalid density.\n"; return 1; }         // ...
+    if (threads <= 0) threads = 1;                                              // hardware_concurrency() may report 0.
+
+    ThreadPool pool(threads);                                                   // Same setup as matrix_ops.
+    mt19937_64 rng(seed);                                                       // Input generator.
+    ostream nullOut(new NullBuffer);                                            // Sink for printMatrix.
+    const string input = "matrix_ops_bench.tmp";                                // Generated input file.
+    vector<Result> results;                                                     // Everything measured.
+    for (int n : sizes)                                                         // Each size...
+        for (double d : densities) {                                            // ...and density.
+            cerr << "bench: N=" << n << " density=" << d << '\n';               // Progress.
+            if (!writeInput(input, n, d, rng)) {                                // Fresh input file.
+                cerr << "Error writing file.\n";                                // ...
+                return 1;                                                       // ...
+            }
+            Matrix A, B;                                                        // Loaded operands.
+            int N = 0;                                                          // ...
+            double nn = (double)n * n;                                          // Values per matrix.
+            auto add1 = [&](const string& op, double work, const function<void()>& body) { // Measure and keep.
+                results.push_back(measure(op, n, d, reps, work, body));         // ...
+            };
+            add1("load", 2 * nn, [&] { loadMatrices(input, A, B, N, &pool); }); // Parse the text file.
+            strassen::prepare(A, B, N, &pool);                                  // Like matrix_ops after loading.
+            add1("add", nn, [&] { Matrix C = add(A, B, N, &pool); });           // A + B.
+            add1("multiply", multiplyWork(A, B, N), [&] { Matrix C = multiply(A, B, N, &pool); }); // A * B.
+            volatile long long sink = 0;                                        // Keeps the sums alive.
+            add1("diag", 2.0 * n, [&] { sink = sink + mainDiagonalSum(A, N) + secondaryDiagonalSum(A, N); }); // Both sums.
+            int k = 0;                                                          // Varies the indices.
+            add1("swapRows", 2.0 * n, [&] { k++; swapRows(A, N, k % N, (k * 7 + 3) % N); }); // O(1) index swap.
+            add1("swapCols", 2.0 * n, [&] { k++; swapCols(A, N, k % N, (k * 7 + 3) % N, &pool); }); // O(N) or O(nnz).
+            add1("updateCell", 1, [&] { k++; updateCell(B, N, k % N, (k * 13) % N, 2 * k + 1); }); // Nonzero: a real store.
+            add1("printMatrix", nn, [&] { printMatrix(A, "A:", nullOut); });    // Formatting only.
+        }
+    delete nullOut.rdbuf();                                                     // Release the sink.
+    remove(input.c_str());                                                      // Clean up the input file.
+
+    ofstream file;                                                              // --out destination.
+    if (!outPath.empty()) {                                                     // Write to a file?
+        file.open(outPath);                                                     // ...
+        if (!file) { cerr << "Error writing file.\n"; return 1; }               // ...
+    }
+    ostream& os = outPath.empty() ? cout : file;                                // Report destination.
+    if (format == "json") writeJsonReport(os, results);                         // ...
+    else writeCsvReport(os, results);                                           // ...
+    return 0;                                                                   // Success.
+}
@@ -6,109 +6,1924 @@
 #include <limits>                        // Provides std::numeric_limits for flushing input.
 #include <sstream>                       // Provides std::istringstream for parsing from strings.
 #include <climits>                       // Provides INT_MIN and INT_MAX bounds.
+#include <cstring>                       // Provides std::memset and std::memcpy for raw buffers.
+#include <memory>                        // Provides std::unique_ptr for owning the matrix buffer.
+#include <new>                           // Provides std::align_val_t for aligned allocation.
+#include <utility>                       // Provides std::swap and std::move.
+#include <algorithm>                     // Provides std::min for block sizes.
+#include <cstdlib>                       // Provides std::getenv for the kernel override.
+#include <thread>                        // Provides std::thread for the worker pool.
+#include <mutex>                         // Provides std::mutex and std::lock_guard.
+#include <condition_variable>            // Lets idle workers sleep until there is work.
+#include <atomic>                        // Provides std::atomic counters shared by workers.
+#include <deque>                         // Provides std::deque for per-worker task queues.
+#include <functional>                    // Provides std::function for task bodies.
+#include <charconv>                      // Provides std::from_chars for fast integer parsing.
+#include <cstdint>                       // Provides fixed-width types for the binary header.
+#include <fcntl.h>                       // Provides open() for memory-mapping input files.
+#include <sys/mman.h>                    // Provides mmap() and munmap().
+#include <sys/stat.h>                    // Provides fstat() to size the mapping.
+#include <unistd.h>                      // Provides read() and close().
+#include <chrono>                        // Provides timers for calibrating the Strassen cutoff.
+#ifdef __linux__
+#include <linux/perf_event.h>            // Provides perf_event_attr for --stats hardware counters.
+#include <sys/syscall.h>                 // Provides SYS_perf_event_open.
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>                   // Provides AVX2/AVX-512 intrinsics.
+#endif
 using namespace std;                     // Make standard library names shorter (beginner-friendly).
 
-using Matrix = vector<vector<long long>>;    // Alias for a square matrix of long long values.
+using u64 = unsigned long long;                                                 // Wrapping arithmetic and raw words.
 
-// Loads N and then two NN matrices from a text file.                         //
-bool loadMatrices(const string& filename, Matrix& A, Matrix& B, int& N) {       // Function to read matrices from file.
-    ifstream fin(filename);                                                     // Open the file for reading.
-    if (!fin) {                                                                 // Check if the file failed to open.
-        cout << "Error opening file.\n";                                        // Inform the user about the issue.
+// Square NN matrix of long long stored in ONE row-major buffer.               //
+// Each row starts on a 64-byte boundary (the stride is N rounded up to 8       //
+// values), so there is a single heap allocation per matrix and rows are        //
+// cache-line aligned. Row swaps only exchange entries of a row-permutation     //
+// index; the index is created lazily, so fresh matrices never allocate it.     //
+// A matrix can also live inside memory it does not own (a mapped binary        //
+// file); it then keeps that mapping alive through a shared owner handle.       //
+// Every matrix carries a version number that changes whenever its contents     //
+// do, so cached results can tell whether they are still up to date.            //
+// A matrix can instead be sparse: compressed sparse rows (CSR) that keep       //
+// only the stored entries of each row, sorted by column. The row index         //
+// works the same way for both kinds. row() and operator() need a dense         //
+// matrix; at(), set() and rowData() work for either.                           //
+class Matrix {                                                                  // Replaces the old vector<vector<long long>>.
+public:                                                                         // Public interface.
+    static constexpr size_t kAlign = 64;                                        // Alignment of the buffer and of every row, in bytes.
+
+    Matrix() = default;                                                         // Empty 00 matrix.
+    explicit Matrix(int n) { reset(n); }                                        // Zero-filled nn matrix.
+
+    Matrix(const Matrix& o) { copyFrom(o); }                                    // Deep copy.
+    Matrix& operator=(const Matrix& o) {                                        // Deep copy assignment.
+        if (this != &o) copyFrom(o);                                            // Ignore self-assignment.
+        return *this;                                                           // Allow chaining.
+    }
+    Matrix(Matrix&& o) noexcept { *this = move(o); }                            // Moves just steal the buffer.
+    Matrix& operator=(Matrix&& o) noexcept {                                    // Same for move assignment.
+        owned_ = move(o.owned_);                                                // Take the buffer (if we own one).
+        external_ = move(o.external_);                                          // Or the handle keeping it alive.
+        data_ = o.data_;                                                        // Same rows.
+        n_ = o.n_;                                                              // Same dimension.
+        stride_ = o.stride_;                                                    // Same row pitch.
+        perm_ = move(o.perm_);                                                  // Same row order.
+        sparse_ = o.sparse_;                                                    // Same kind of storage.
+        rowPtr_ = move(o.rowPtr_);                                              // Sparse entries, if any.
+        cols_ = move(o.cols_);                                                  // ...
+        vals_ = move(o.vals_);                                                  // ...
+        version_ = o.version_;                                                  // Same contents, same version.
+        o.sparse_ = false;                                                      // ...
+        o.data_ = nullptr;                                                      // Leave o as an empty 00 matrix.
+        o.n_ = 0;                                                               // ...
+        o.stride_ = 0;                                                          // ...
+        return *this;                                                           // Allow chaining.
+    }
+
+    // Wraps n rows of 'stride' values at 'data' without copying them.          //
+    // 'owner' must keep that memory valid; the matrix holds on to it.          //
+    static Matrix wrap(shared_ptr<void> owner, long long* data, int n, size_t stride) { // Zero-copy constructor.
+        Matrix m;                                                               // Start empty.
+        m.external_ = move(owner);                                              // Keep the memory alive.
+        m.data_ = data;                                                         // Rows start here.
+        m.n_ = n;                                                               // Dimension.
+        m.stride_ = stride;                                                     // Row pitch used by the storage.
+        return m;                                                               // Moved out to the caller.
+    }
+
+    // Builds a sparse nn matrix from CSR arrays: row i is entries             //
+    // rowPtr[i] .. rowPtr[i+1]-1 of cols/vals, with increasing columns.        //
+    static Matrix fromCsr(int n, vector<int64_t> rowPtr, vector<int> cols, vector<long long> vals) { // Sparse constructor.
+        Matrix m;                                                               // Start empty.
+        m.n_ = n;                                                               // Dimension.
+        m.sparse_ = true;                                                       // CSR storage, no dense buffer.
+        m.rowPtr_ = move(rowPtr);                                               // n + 1 row starts.
+        m.cols_ = move(cols);                                                   // Column of every entry.
+        m.vals_ = move(vals);                                                   // Value of every entry.
+        return m;                                                               // Moved out to the caller.
+    }
+
+    // Sparse storage is used while at most 10% of the entries are nonzero;     //
+    // beyond that the dense kernels win and the memory saving is small.        //
+    static bool preferSparse(size_t nnz, int n) { return nnz * 10 <= (size_t)n * n; } // Shared density rule.
+
+    // Re-sizes to nn, zero-fills, and forgets any row permutation.            //
+    void reset(int n) {                                                         // (Re)allocate storage.
+        allocateDense(n);                                                       // Zero-filled dense buffer.
+        clearSparse();                                                          // Drop any CSR entries.
+        perm_.clear();                                                          // Identity row order.
+        touch();                                                                // New contents.
+    }
+
+    int size() const { return n_; }                                             // Dimension N.
+    u64 version() const { return version_; }                                    // Changes whenever the contents do.
+    // Marks the contents as changed. The editing functions below call this;    //
+    // code that writes through row() or operator() directly must too.          //
+    void touch() { version_ = nextVersion(); }                                  // Fresh, never-reused number.
+    size_t stride() const { return stride_; }                                   // Distance between rows, in elements.
+    int rowIndex(int i) const { return perm_.empty() ? i : perm_[i]; }          // Physical row that holds logical row i.
+    bool rowsInOrder() const { return perm_.empty(); }                          // Row i is stored i-th (no row index).
+
+    long long* row(int i) { return data_ + rowIndex(i) * stride_; }             // Pointer to the start of row i.
+    const long long* row(int i) const {                                         // Read-only pointer to row i.
+        return data_ + rowIndex(i) * stride_;                                   // Same computation.
+    }
+    long long& operator()(int i, int j) { return row(i)[j]; }                   // Element (i, j).
+    const long long& operator()(int i, int j) const { return row(i)[j]; }       // Read-only element (i, j).
+
+    // Sparse matrices only: the stored entries of row i, by increasing column. //
+    bool isSparse() const { return sparse_; }                                   // CSR storage?
+    size_t nnz() const { return vals_.size(); }                                 // Stored entries of a sparse matrix.
+    int rowNnz(int i) const {                                                   // Entries stored in row i.
+        int p = rowIndex(i);                                                    // Physical row.
+        return (int)(rowPtr_[p + 1] - rowPtr_[p]);                              // Length of its segment.
+    }
+    const int* rowCols(int i) const { return cols_.data() + rowPtr_[rowIndex(i)]; } // Columns of row i, increasing.
+    int* rowCols(int i) { return cols_.data() + rowPtr_[rowIndex(i)]; }         // Writable; keep them sorted.
+    const long long* rowVals(int i) const { return vals_.data() + rowPtr_[rowIndex(i)]; } // Values of row i.
+    long long* rowVals(int i) { return vals_.data() + rowPtr_[rowIndex(i)]; }   // Writable.
+
+    // Element (i, j) of a dense or sparse matrix.                              //
+    long long at(int i, int j) const {                                          // Read-only, any storage.
+        if (!sparse_) return row(i)[j];                                         // Dense: direct.
+        const int* c = rowCols(i);                                              // Sparse: binary search the row.
+        const int* e = c + rowNnz(i);                                           // End of the row.
+        const int* k = lower_bound(c, e, j);                                    // First column >= j.
+        return k != e && *k == j ? rowVals(i)[k - c] : 0;                       // Entries not stored are 0.
+    }
+
+    // Sets element (i, j) of a dense or sparse matrix. A new nonzero in a      //
+    // sparse matrix is inserted in place, moving every entry after it.         //
+    void set(int i, int j, long long v) {                                       // Callers touch() as with operator().
+        if (!sparse_) { row(i)[j] = v; return; }                                // Dense: direct.
+        int p = rowIndex(i);                                                    // Physical row.
+        auto b = cols_.begin() + rowPtr_[p], e = cols_.begin() + rowPtr_[p + 1]; // Its segment.
+        auto k = lower_bound(b, e, j);                                          // Where column j is or belongs.
+        size_t pos = k - cols_.begin();                                         // As an index.
+        if (k != e && *k == j) { vals_[pos] = v; return; }                      // Already stored: overwrite.
+        if (v == 0) return;                                                     // Not stored and zero: nothing to do.
+        cols_.insert(k, j);                                                     // New entry at its sorted position.
+        vals_.insert(vals_.begin() + pos, v);                                   // ...
+        for (int q = p + 1; q <= n_; q++) rowPtr_[q]++;                         // Later rows start one entry later.
+    }
+
+    // Row i as N contiguous values: a dense row itself, or a sparse row        //
+    // expanded into 'scratch'. Lets output code handle both kinds alike.       //
+    const long long* rowData(int i, vector<long long>& scratch) const {         // Valid until the next call.
+        if (!sparse_) return row(i);                                            // Dense: no copy.
+        scratch.assign(n_, 0);                                                  // Zeros...
+        const int* c = rowCols(i);                                              // ...
+        const long long* v = rowVals(i);                                        // ...
+        for (int k = 0, e = rowNnz(i); k < e; k++) scratch[c[k]] = v[k];        // ...plus the stored entries.
+        return scratch.data();                                                  // Expanded row.
+    }
+
+    // Switches a sparse matrix to dense storage; the contents (and version)    //
+    // stay the same. Physical rows keep their slots, so perm_ stays valid.     //
+    void toDense() {                                                            // CSR -> one aligned buffer.
+        if (!sparse_) return;                                                   // Already dense.
+        allocateDense(n_);                                                      // Zero-filled buffer.
+        for (int p = 0; p < n_; p++)                                            // Each physical row.
+            for (int64_t k = rowPtr_[p]; k < rowPtr_[p + 1]; k++)               // Each stored entry.
+                data_[p * stride_ + cols_[k]] = vals_[k];                       // Scatter it.
+        clearSparse();                                                          // CSR arrays are no longer needed.
+    }
+
+    // Exchanges logical rows r1 and r2 in O(1) by editing the row index.       //
+    void permuteRows(int r1, int r2) {                                          // No data is moved.
+        if (perm_.empty()) {                                                    // First swap: build the identity index.
+            perm_.resize(n_);                                                   // One slot per row.
+            for (int i = 0; i < n_; i++) perm_[i] = i;                          // Row i is stored in row i.
+        }
+        swap(perm_[r1], perm_[r2]);                                             // Exchange where the two rows live.
+    }
+
+private:                                                                        // Storage details.
+    struct AlignedDelete {                                                      // Deleter matching allocate().
+        void operator()(long long* p) const {                                   // Called by unique_ptr.
+            ::operator delete[](p, align_val_t(kAlign));                        // Release with the same alignment.
+        }
+    };
+
+    void allocateDense(int n) {                                                 // Zero-filled dense buffer for nn.
+        n_ = n;                                                                 // Remember the dimension.
+        stride_ = ((size_t)n + 7) & ~(size_t)7;                                 // Round up to a multiple of 8 values (64 bytes).
+        owned_.reset(allocate(stride_ * (size_t)n));                            // One aligned allocation for all rows.
+        external_.reset();                                                      // Drop any borrowed storage.
+        data_ = owned_.get();                                                   // Rows now live in our own buffer.
+        if (n > 0) memset(data_, 0, stride_ * (size_t)n * sizeof(long long));   // Start from all zeros (padding too).
+    }
+    void clearSparse() {                                                        // Back to dense-only state.
+        sparse_ = false;                                                        // ...
+        vector<int64_t>().swap(rowPtr_);                                        // Release the memory too.
+        vector<int>().swap(cols_);                                              // ...
+        vector<long long>().swap(vals_);                                        // ...
+    }
+
+    static long long* allocate(size_t count) {                                  // Aligned raw allocation.
+        if (count == 0) return nullptr;                                         // Nothing to allocate for 00.
+        return static_cast<long long*>(                                         // Cast raw memory to elements.
+            ::operator new[](count * sizeof(long long), align_val_t(kAlign)));  // 64-byte aligned block.
+    }
+
+    void copyFrom(const Matrix& o) {                                            // Shared by copy ctor/assignment.
+        n_ = o.n_;                                                              // Same dimension.
+        stride_ = o.stride_;                                                    // Same row pitch.
+        owned_.reset(allocate(stride_ * (size_t)n_));                           // Fresh buffer of the same size.
+        external_.reset();                                                      // Copies always own their storage.
+        data_ = owned_.get();                                                   // Rows live in the new buffer.
+        if (data_)                                                              // Copy only if there is data.
+            memcpy(data_, o.data_, stride_ * (size_t)n_ * sizeof(long long));   // Raw copy of all rows.
+        perm_ = o.perm_;                                                        // Keep the same row order.
+        sparse_ = o.sparse_;                                                    // Same kind of storage.
+        rowPtr_ = o.rowPtr_;                                                    // Sparse entries (empty if dense).
+        cols_ = o.cols_;                                                        // ...
+        vals_ = o.vals_;                                                        // ...
+        version_ = o.version_;                                                  // Same contents, same version.
+    }
+
+    unique_ptr<long long[], AlignedDelete> owned_;                              // The single row-major buffer, if owned.
+    shared_ptr<void> external_;                                                 // Keeps borrowed storage alive, if any.
+    long long* data_ = nullptr;                                                 // First stored row (owned or borrowed).
+    int n_ = 0;                                                                 // Dimension N.
+    size_t stride_ = 0;                                                         // Elements per stored row (>= N).
+    vector<int> perm_;                                                          // Logical-to-physical rows; empty = identity.
+    bool sparse_ = false;                                                       // CSR storage instead of the buffer.
+    vector<int64_t> rowPtr_;                                                    // CSR: start of each physical row (n + 1).
+    vector<int> cols_;                                                          // CSR: column of each entry.
+    vector<long long> vals_;                                                    // CSR: value of each entry.
+    u64 version_ = nextVersion();                                               // Identifies the current contents.
+
+    static u64 nextVersion() {                                                  // Unique across all matrices.
+        static atomic<u64> counter{0};                                          // Shared by every Matrix.
+        return ++counter;                                                       // Never returns 0.
+    }
+};
+
+// Persistent pool of worker threads that run parallelFor() jobs.               //
+// Every thread (the caller counts as worker 0) owns a task deque: it pops      //
+// its own tasks from the back and, once idle, steals from the front of the     //
+// other deques, so uneven tiles still keep all cores busy. In deterministic    //
+// mode nobody steals: task t always runs on worker t % size(), making the      //
+// schedule reproducible. Results never depend on the schedule anyway,          //
+// because every task writes a disjoint part of the output.                     //
+class ThreadPool {                                                              // Created once in main and reused.
+public:                                                                         // Public interface.
+    explicit ThreadPool(int threads) : queues_(max(1, threads)) {               // One deque per thread.
+        for (int t = 1; t < size(); t++)                                        // Worker 0 is the calling thread.
+            workers_.emplace_back([this, t] { workerLoop(t); });                // Start the background workers.
+    }
+    ~ThreadPool() {                                                             // Stops and joins all workers.
+        { lock_guard<mutex> lk(m_); stop_ = true; }                             // Tell workers to exit.
+        wake_.notify_all();                                                     // Wake anyone who is waiting.
+        for (thread& w : workers_) w.join();                                    // Wait for them to finish.
+    }
+    ThreadPool(const ThreadPool&) = delete;                                     // Threads cannot be copied.
+    ThreadPool& operator=(const ThreadPool&) = delete;                          // Neither can the pool.
+
+    int size() const { return (int)queues_.size(); }                            // Number of threads, caller included.
+    void setDeterministic(bool on) { deterministic_ = on; }                     // Disable stealing for a fixed schedule.
+    bool deterministic() const { return deterministic_; }                       // Current scheduling mode.
+
+    // Runs body(t) for every t in [0, count) and returns when all are done.    //
+    // Must not be called from inside a task.                                   //
+    void parallelFor(int count, const function<void(int)>& body) {              // Fork-join over count tasks.
+        if (count <= 0) return;                                                 // Nothing to do.
+        if (size() == 1 || count == 1) {                                        // No point in waking workers.
+            for (int t = 0; t < count; t++) body(t);                            // Run inline.
+            return;                                                             // Done.
+        }
+        body_ = &body;                                                          // Publish the job before any task.
+        pending_ = count;                                                       // Tasks still to finish.
+        for (int t = 0; t < count; t++) {                                       // Deal tasks round-robin.
+            Queue& q = queues_[t % size()];                                     // Owner of task t.
+            lock_guard<mutex> lk(q.m);                                          // Deques are shared with thieves.
+            q.tasks.push_back(t);                                               // Queue it.
+        }
+        { lock_guard<mutex> lk(m_); generation_++; }                            // Mark a new job.
+        wake_.notify_all();                                                     // Start the workers.
+        runTasks(0);                                                            // The caller works too.
+        unique_lock<mutex> lk(m_);                                              // Then waits for stragglers.
+        done_.wait(lk, [this] { return pending_ == 0; });                       // All tasks have finished.
+    }
+
+private:                                                                        // Scheduling details.
+    struct Queue {                                                              // One per thread.
+        mutex m;                                                                // Guards tasks.
+        deque<int> tasks;                                                       // Task indices still to run.
+    };
+
+    bool popLocal(int self, int& task) {                                        // Newest task from our own deque.
+        Queue& q = queues_[self];                                               // Our deque.
+        lock_guard<mutex> lk(q.m);                                              // Thieves may touch it too.
+        if (q.tasks.empty()) return false;                                      // Nothing left locally.
+        task = q.tasks.back();                                                  // LIFO for the owner.
+        q.tasks.pop_back();                                                     // Remove it.
+        return true;                                                            // Got one.
+    }
+
+    bool steal(int self, int& task) {                                           // Oldest task from another deque.
+        for (int k = 1; k < size(); k++) {                                      // Visit the other threads in turn.
+            Queue& q = queues_[(self + k) % size()];                            // Victim deque.
+            lock_guard<mutex> lk(q.m);                                          // Lock the victim.
+            if (q.tasks.empty()) continue;                                      // Try the next one.
+            task = q.tasks.front();                                             // FIFO for thieves.
+            q.tasks.pop_front();                                                // Remove it.
+            return true;                                                        // Stolen.
+        }
+        return false;                                                           // Everyone is empty.
+    }
+
+    void runTasks(int self) {                                                   // Drain work until none is left.
+        int task;                                                               // Index handed to the body.
+        while (popLocal(self, task) || (!deterministic_ && steal(self, task))) { // Own work first, then steal.
+            (*body_.load())(task);                                              // Run the task.
+            if (pending_.fetch_sub(1) == 1) {                                   // Last task of the job?
+                lock_guard<mutex> lk(m_);                                       // Pair with the waiter's lock.
+                done_.notify_all();                                             // Release parallelFor().
+            }
+        }
+    }
+
+    void workerLoop(int self) {                                                 // Body of each background thread.
+        unsigned long seen = 0;                                                 // Last job this worker looked at.
+        while (true) {                                                          // Until the pool is destroyed.
+            {
+                unique_lock<mutex> lk(m_);                                      // Sleep until there is news.
+                wake_.wait(lk, [&] { return stop_ || generation_ != seen; });   // New job or shutdown.
+                if (stop_) return;                                              // Pool is going away.
+                seen = generation_;                                             // Remember this job.
+            }
+            runTasks(self);                                                     // Help with the job.
+        }
+    }
+
+    vector<Queue> queues_;                                                      // Per-thread task deques.
+    vector<thread> workers_;                                                    // Background threads (size()-1 of them).
+    mutex m_;                                                                   // Guards generation_ and stop_.
+    condition_variable wake_;                                                   // Signals a new job or shutdown.
+    condition_variable done_;                                                   // Signals that pending_ reached zero.
+    atomic<const function<void(int)>*> body_{nullptr};                          // Current job.
+    atomic<int> pending_{0};                                                    // Unfinished tasks of the current job.
+    unsigned long generation_ = 0;                                              // Job counter workers wait on.
+    bool stop_ = false;                                                         // Set by the destructor.
+    atomic<bool> deterministic_{false};                                         // Static schedule when true.
+};
+
+// Runs body(t) for t in [0, count) on the pool, or inline without one.         //
+static void forEachTask(ThreadPool* pool, int count, const function<void(int)>& body) { // Shared by all parallel loops.
+    if (pool) pool->parallelFor(count, body);                                   // Spread the tasks over the workers.
+    else for (int t = 0; t < count; t++) body(t);                               // Or run them one after another.
+}
+
+// Runs body(i0, i1) on consecutive row ranges that cover [0, n). A range       //
+// holds about 64K elements, but there are at most 64 ranges per worker.        //
+static void forEachRowRange(ThreadPool* pool, int n, const function<void(int, int)>& body) { // Row-parallel loops.
+    int rows = max(1, (1 << 16) / max(1, n));                                   // About 64K elements per range.
+    if (pool) rows = max(rows, (n + pool->size() * 64 - 1) / (pool->size() * 64)); // Bound the task count.
+    forEachTask(pool, (n + rows - 1) / rows, [&](int t) {                       // One task per range.
+        body(t * rows, min(n, (t + 1) * rows));                                 // Rows [i0, i1).
+    });
+}
+
+// ---- Per-operation statistics (--stats) -----------------------------------  //
+// With --stats every operation reports its wall time on stderr, plus CPU       //
+// cycles, instructions, cache misses and branch misses when Linux perf         //
+// events are available. Counters are opened before the worker threads are      //
+// started, so the work done by the pool is included.                           //
+class PerfCounters {                                                            // Thin wrapper over perf_event_open.
+public:                                                                         // Public interface.
+    static constexpr int kCount = 4;                                            // Events measured.
+    static const char* name(int k) {                                            // Label of event k.
+        static const char* const names[kCount] = {"cycles", "instructions", "cache-misses", "branch-misses"}; // ...
+        return names[k];                                                        // ...
+    }
+    ~PerfCounters() { for (int fd : fd_) if (fd >= 0) close(fd); }              // Release the events.
+
+    // Opens every event for this process and the threads it starts later.      //
+    bool open() {                                                               // False if none is available.
+#ifdef __linux__
+        const u64 config[kCount] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, // Same order as name().
+                                    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES}; // ...
+        for (int k = 0; k < kCount; k++) {                                      // Each event on its own.
+            perf_event_attr attr = {};                                          // Zero everything first.
+            attr.type = PERF_TYPE_HARDWARE;                                     // Generic hardware event.
+            attr.size = sizeof attr;                                            // ABI version.
+            attr.config = config[k];                                            // Which event.
+            attr.inherit = 1;                                                   // Also count new threads.
+            attr.exclude_kernel = 1;                                            // User space only; needs no privileges
+            attr.exclude_hv = 1;                                                // under the default paranoid level.
+            fd_[k] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);    // This process, any CPU.
+        }
+#endif
+        for (int fd : fd_) if (fd >= 0) return true;                            // At least one event works.
+        return false;                                                           // No counters here.
+    }
+    bool has(int k) const { return fd_[k] >= 0; }                               // Event k is being counted.
+    void read(u64 out[kCount]) const {                                          // Current totals.
+        for (int k = 0; k < kCount; k++)                                        // Each event.
+            if (fd_[k] < 0 || ::read(fd_[k], &out[k], sizeof out[k]) != (ssize_t)sizeof out[k]) out[k] = 0; // 0 if missing.
+    }
+
+private:                                                                        // Event handles.
+    int fd_[kCount] = {-1, -1, -1, -1};                                         // -1 = not available.
+};
+
+struct OpStats {                                                                // State behind --stats.
+    bool enabled = false;                                                       // Set by main().
+    int depth = 0;                                                              // Running timers; only the outermost reports.
+    PerfCounters counters;                                                      // Hardware events, if any.
+};
+static OpStats opStats;                                                         // One per program, like strassen::cutoff.
+
+// Times one operation for --stats: create it at the top of the operation;      //
+// the line is printed when it goes out of scope. Free when --stats is off.     //
+class OpTimer {                                                                 // RAII timer.
+public:                                                                         // Public interface.
+    explicit OpTimer(const char* op) : op_(op) {                                // Starts timing 'op'.
+        if (!opStats.enabled || opStats.depth++ > 0) return;                    // Off, or inside another operation.
+        active_ = true;                                                         // This timer reports.
+        opStats.counters.read(start_);                                          // Counter values now.
+        t0_ = chrono::steady_clock::now();                                      // Wall clock now.
+    }
+    ~OpTimer() {                                                                // Reports the operation.
+        if (!opStats.enabled) return;                                           // Nothing was started.
+        opStats.depth--;                                                        // Leaving this operation.
+        if (!active_) return;                                                   // Nested: the outer one reports.
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0_).count(); // Elapsed time.
+        u64 end[PerfCounters::kCount];                                          // Counter values now.
+        opStats.counters.read(end);                                             // ...
+        ostringstream line;                                                     // Built first, written at once.
+        line << "[stats] " << op_ << ": " << fixed << setprecision(3) << ms << " ms"; // Wall time.
+        for (int k = 0; k < PerfCounters::kCount; k++)                          // Counter deltas.
+            if (opStats.counters.has(k)) line << ", " << end[k] - start_[k] << ' ' << PerfCounters::name(k); // ...
+        if (opStats.counters.has(0) && opStats.counters.has(1) && end[0] > start_[0]) // Instructions per cycle.
+            line << ", IPC " << setprecision(2) << (double)(end[1] - start_[1]) / (double)(end[0] - start_[0]); // ...
+        cerr << line.str() << '\n';                                             // Keeps stdout unchanged.
+    }
+
+private:                                                                        // Timer state.
+    const char* op_;                                                            // Operation name.
+    bool active_ = false;                                                       // Reports when destroyed?
+    u64 start_[PerfCounters::kCount] = {};                                      // Counters at the start.
+    chrono::steady_clock::time_point t0_;                                       // Time at the start.
+};
+
+// Read-only or copy-on-write view of a whole file. Uses mmap when it can       //
+// and falls back to reading the file into memory (e.g. for pipes).             //
+class MappedFile {                                                              // RAII owner of the mapping.
+public:                                                                         // Public interface.
+    MappedFile() = default;                                                     // Nothing opened yet.
+    ~MappedFile() { if (mapped_) munmap(data_, size_); }                        // Unmap on destruction.
+    MappedFile(const MappedFile&) = delete;                                     // A mapping has one owner.
+    MappedFile& operator=(const MappedFile&) = delete;                          // Same for assignment.
+
+    // Maps 'path'. 'writable' gives a private copy-on-write mapping, so        //
+    // edits never reach the file on disk.                                      //
+    bool open(const string& path, bool writable) {                              // Returns false if unreadable.
+        int fd = ::open(path.c_str(), O_RDONLY);                                // Open the file descriptor.
+        if (fd < 0) return false;                                               // Missing or not permitted.
+        struct stat st;                                                         // File metadata.
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {     // Only regular, non-empty files map.
+            int prot = PROT_READ | (writable ? PROT_WRITE : 0);                 // Writes stay private to us.
+            void* p = mmap(nullptr, (size_t)st.st_size, prot, MAP_PRIVATE, fd, 0); // Map the whole file.
+            if (p != MAP_FAILED) {                                              // Mapping worked.
+                madvise(p, (size_t)st.st_size, MADV_WILLNEED);                  // Start reading ahead now.
+                data_ = (char*)p;                                               // Remember where it is.
+                size_ = (size_t)st.st_size;                                     // And how big it is.
+                mapped_ = true;                                                 // Must munmap later.
+                ::close(fd);                                                    // The mapping outlives the descriptor.
+                return true;                                                    // Done.
+            }
+        }
+        char chunk[1 << 16];                                                    // Fallback: plain reads.
+        ssize_t got;                                                            // Bytes returned by read().
+        while ((got = ::read(fd, chunk, sizeof chunk)) > 0)                     // Until end of file.
+            copy_.insert(copy_.end(), chunk, chunk + got);                      // Append to the in-memory copy.
+        ::close(fd);                                                            // Done with the descriptor.
+        if (got < 0) return false;                                              // Read error.
+        data_ = copy_.data();                                                   // Serve from the copy.
+        size_ = copy_.size();                                                   // Its length.
+        return true;                                                            // Done.
+    }
+
+    char* data() const { return data_; }                                        // First byte of the file.
+    size_t size() const { return size_; }                                       // File length in bytes.
+
+private:                                                                        // Mapping details.
+    char* data_ = nullptr;                                                      // Mapped (or copied) bytes.
+    size_t size_ = 0;                                                           // Their count.
+    bool mapped_ = false;                                                       // True if data_ came from mmap.
+    vector<char> copy_;                                                         // Storage for the fallback path.
+};
+
+// ---- Binary matrix container ----------------------------------------------- //
+// Layout: a 64-byte header, then 'count' matrices of n rows  stride values    //
+// (row-major, native int64, rows zero-padded to the stride). Because the       //
+// header is 64 bytes and the stride is a multiple of 8 values, every row of    //
+// a mapped file is 64-byte aligned and can be used directly as storage.        //
+struct BinaryHeader {                                                           // Exactly 64 bytes on disk.
+    char magic[8];                                                              // "MXOPSBIN".
+    uint32_t version;                                                           // Format version (1).
+    uint32_t dtype;                                                             // Element type (kDtypeInt64).
+    uint32_t count;                                                             // Matrices stored: 2 for A and B.
+    uint32_t n;                                                                 // Dimension N.
+    uint64_t stride;                                                            // Stored values per row (>= N, multiple of 8).
+    uint64_t checksum;                                                          // binaryChecksum() of the payload.
+    uint8_t reserved[24];                                                       // Zero; room for later fields.
+};
+static_assert(sizeof(BinaryHeader) == 64, "header must keep rows aligned");     // Layout is part of the format.
+static const char kBinaryMagic[8] = {'M', 'X', 'O', 'P', 'S', 'B', 'I', 'N'};   // Identifies binary files.
+static const uint32_t kDtypeInt64 = 1;                                          // Only long long is supported.
+
+// Checksum of 'count' payload words starting at word index 'first':            //
+// the wrapping sum of w[i] ^ (i * golden ratio). Chunks can be summed in any   //
+// order, so it is computed in parallel.                                        //
+static u64 checksumWords(const u64* w, size_t first, size_t count) {            // One chunk of the payload.
+    u64 s = 0;                                                                  // Running sum (wraps).
+    for (size_t i = 0; i < count; i++)                                          // Every word in the chunk.
+        s += w[i] ^ ((first + i) * 0x9E3779B97F4A7C15ULL);                      // Position-dependent mix.
+    return s;                                                                   // Partial checksum.
+}
+
+static u64 binaryChecksum(const u64* w, size_t count, ThreadPool* pool) {       // Whole payload.
+    const size_t perTask = 1 << 20;                                             // About 8 MB per task.
+    int tasks = (int)((count + perTask - 1) / perTask);                         // Number of chunks.
+    vector<u64> part(tasks, 0);                                                 // One partial sum per chunk.
+    forEachTask(pool, tasks, [&](int t) {                                       // Sum chunks in parallel.
+        size_t first = (size_t)t * perTask;                                     // First word of chunk t.
+        part[t] = checksumWords(w + first, first, min(perTask, count - first)); // Its partial sum.
+    });
+    u64 s = 0;                                                                  // Combine the partial sums.
+    for (u64 p : part) s += p;                                                  // Addition is order-independent.
+    return s;                                                                   // Final checksum.
+}
+
+// Appends one container with 'count' matrices (all NN) to a binary stream.    //
+bool writeBinary(ostream& fout, const Matrix* const* ms, int count) {           // Shared by saveBinary and --output=bin.
+    streampos start = fout.tellp();                                             // Where this container begins.
+    int N = ms[0]->size();                                                      // Shared dimension.
+    size_t stride = ((size_t)N + 7) & ~(size_t)7;                               // Same padding as Matrix.
+    BinaryHeader h = {};                                                        // Zero everything first.
+    memcpy(h.magic, kBinaryMagic, sizeof h.magic);                              // File signature.
+    h.version = 1;                                                              // Current format.
+    h.dtype = kDtypeInt64;                                                      // long long elements.
+    h.count = (uint32_t)count;                                                  // How many matrices follow.
+    h.n = (uint32_t)N;                                                          // Their dimension.
+    h.stride = stride;                                                          // Values per stored row.
+    fout.write((const char*)&h, sizeof h);                                      // Placeholder header (checksum later).
+    vector<u64> rowBuf(stride, 0);                                              // One padded row.
+    vector<long long> scratch;                                                  // Expanded sparse row.
+    size_t word = 0;                                                            // Payload position of rowBuf[0].
+    for (int m = 0; m < count; m++)                                             // Each matrix in turn.
+        for (int i = 0; i < N; i++) {                                           // Logical row order.
+            memcpy(rowBuf.data(), ms[m]->rowData(i, scratch), (size_t)N * sizeof(u64)); // Real values; padding stays 0.
+            h.checksum += checksumWords(rowBuf.data(), word, stride);           // Checksum as we go.
+            fout.write((const char*)rowBuf.data(), stride * sizeof(u64));       // Write the padded row.
+            word += stride;                                                     // Advance the position.
+        }
+    streampos finish = fout.tellp();                                            // End of this container.
+    fout.seekp(start);                                                          // Back to the header.
+    fout.write((const char*)&h, sizeof h);                                      // Now with the real checksum.
+    fout.seekp(finish);                                                         // Later containers go after it.
+    return (bool)fout;                                                          // False if any write failed.
+}
+
+// Writes 'count' matrices (all NN) to 'filename' in the binary format.        //
+bool saveBinary(const string& filename, const Matrix* const* ms, int count) {   // Function to save matrices.
+    OpTimer timer("saveBinary");                                                // For --stats.
+    ofstream fout(filename, ios::binary);                                       // Open the file for writing.
+    if (!fout) return false;                                                    // Could not create it.
+    return writeBinary(fout, ms, count);                                        // One container with all of them.
+}
+
+// Uses a mapped binary file directly as the storage of A and B.                //
+static bool loadBinary(const shared_ptr<MappedFile>& f, Matrix& A, Matrix& B, int& N, ThreadPool* pool) { // Zero-copy load.
+    BinaryHeader h;                                                             // Copy of the header.
+    memcpy(&h, f->data(), sizeof h);                                            // Avoids unaligned field access.
+    if (h.version != 1 || h.dtype != kDtypeInt64) {                             // Only what we know how to read.
+        cout << "Unsupported binary format.\n";                                 // Explain the problem.
+        return false;                                                           // Signal failure.
+    }
+    if (h.n == 0 || h.n > (uint32_t)INT_MAX || h.stride < h.n || h.stride % 8 != 0) { // Sanity-check the shape.
+        cout << "Invalid N.\n";                                                 // Same message as for text.
         return false;                                                           // Signal failure.
     }
-    if (!(fin >> N) || N <= 0) {                                                // Read N and validate it is positive.
+    size_t avail = (f->size() - sizeof h) / sizeof(u64);                        // Payload words in the file.
+    if (h.count < 1 || h.stride > avail / h.n) {                                // A is missing or truncated.
+        cout << "Not enough numbers for A.\n";                                  // Same message as for text.
+        return false;                                                           // Signal failure.
+    }
+    size_t words = (size_t)h.n * h.stride;                                      // Payload words per matrix (<= avail).
+    if (h.count < 2 || avail - words < words) {                                 // B is missing or truncated.
+        cout << "Not enough numbers for B.\n";                                  // Same message as for text.
+        return false;                                                           // Signal failure.
+    }
+    if (h.count != 2) {                                                         // The checksum covers h.count matrices;
+        cout << "Unsupported binary format.\n";                                 // A and B files hold exactly two.
+        return false;                                                           // Signal failure.
+    }
+    long long* base = (long long*)(f->data() + sizeof h);                       // First row of A.
+    if (binaryChecksum((const u64*)base, 2 * words, pool) != h.checksum) {      // Detect corruption.
+        cout << "Checksum mismatch.\n";                                         // Refuse damaged data.
+        return false;                                                           // Signal failure.
+    }
+    N = (int)h.n;                                                               // Dimension.
+    A = Matrix::wrap(f, base, N, h.stride);                                     // A lives in the mapping.
+    B = Matrix::wrap(f, base + words, N, h.stride);                             // So does B, right after it.
+    return true;                                                                // Successfully loaded both matrices.
+}
+
+// ---- Text matrix parser ---------------------------------------------------- //
+static inline bool isSpace(char c) {                                            // Same set as isspace() in the C locale.
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f'; // No locale lookups.
+}
+
+// Parses one integer at p (which is not whitespace) like 'fin >> v' would:     //
+// optional sign, digits, stop at the first other character. Moves p past it.   //
+static inline bool parseValue(const char*& p, const char* end, long long& v) {  // Hand-written fast path.
+    const char* s = p;                                                          // Start of the number.
+    if (s < end && *s == '+') {                                                 // from_chars rejects '+',
+        ++s;                                                                    // so skip it ourselves.
+        if (s < end && *s == '-') return false;                                 // But "+-5" is still invalid.
+    }
+    from_chars_result r = from_chars(s, end, v);                                // Digits to value, with overflow check.
+    if (r.ec != errc()) return false;                                           // No digits, or out of range.
+    p = r.ptr;                                                                  // Continue after the digits.
+    return true;                                                                // Parsed.
+}
+
+// Number of whitespace-separated tokens in [p, end). 'zeros' receives how      //
+// many of them are written as zero ("0", "-00", ...).                          //
+static size_t countTokens(const char* p, const char* end, size_t& zeros) {      // First pass of the parallel parser.
+    size_t count = 0;                                                           // Tokens seen so far.
+    zeros = 0;                                                                  // Zero tokens seen so far.
+    while (true) {                                                              // One token per iteration.
+        while (p < end && isSpace(*p)) ++p;                                     // Skip whitespace.
+        if (p == end) break;                                                    // Range done.
+        count++;                                                                // A token starts here.
+        if (*p == '+' || *p == '-') ++p;                                        // Optional sign.
+        bool zero = true;                                                       // Only '0' digits so far?
+        for (; p < end && !isSpace(*p); ++p) zero &= *p == '0';                 // Rest of the token.
+        zeros += zero;                                                          // Counts toward the density guess.
+    }
+    return count;                                                               // Tokens in the range.
+}
+
+// Nonzero values one parser chunk found for a sparse matrix, as positions      //
+// (row * N + column) in increasing order.                                      //
+struct FoundEntries {                                                           // Filled by pass 2 of loadText().
+    vector<u64> idx;                                                            // Positions.
+    vector<long long> val;                                                      // Values.
+};
+
+// Builds a CSR matrix from the entries found by 'count' chunks. Chunks         //
+// cover consecutive positions, so concatenating them keeps row order.          //
+static Matrix gatherCsr(int N, FoundEntries* parts, int count, ThreadPool* pool) { // Frees 'parts' as it goes.
+    vector<size_t> off(count + 1, 0);                                           // First output slot of each chunk.
+    for (int c = 0; c < count; c++) off[c + 1] = off[c] + parts[c].idx.size();  // Prefix sums.
+    size_t nnz = off[count];                                                    // Total entries.
+    vector<u64> idx(nnz);                                                       // All positions, in order.
+    vector<int> cols(nnz);                                                      // CSR columns.
+    vector<long long> vals(nnz);                                                // CSR values.
+    forEachTask(pool, count, [&](int c) {                                       // Chunks copy independently.
+        FoundEntries& e = parts[c];                                             // This chunk's entries.
+        for (size_t k = 0; k < e.idx.size(); k++) {                             // Each entry.
+            idx[off[c] + k] = e.idx[k];                                         // Position, for the row starts.
+            cols[off[c] + k] = (int)(e.idx[k] % (u64)N);                        // Column.
+            vals[off[c] + k] = e.val[k];                                        // Value.
+        }
+        e = FoundEntries();                                                     // Release the chunk's memory.
+    });
+    vector<int64_t> rowPtr(N + 1);                                              // Row starts.
+    rowPtr[N] = (int64_t)nnz;                                                   // End of the last row.
+    forEachRowRange(pool, N, [&](int i0, int i1) {                              // Independent binary searches.
+        for (int i = i0; i < i1; i++)                                           // Row i starts at the first
+            rowPtr[i] = lower_bound(idx.begin(), idx.end(), (u64)i * N) - idx.begin(); // position >= i*N.
+    });
+    return Matrix::fromCsr(N, move(rowPtr), move(cols), move(vals));            // Ready-made sparse matrix.
+}
+
+// Parses N and 2*N*N values from text. The bytes after N are split into        //
+// chunks at whitespace; pass 1 counts tokens per chunk so every chunk knows    //
+// the index of its first value, pass 2 parses all chunks in parallel.          //
+// Pass 1 also counts zeros, which decides whether A and B are stored dense     //
+// or sparse (Matrix::preferSparse), so a mostly-zero input never needs an      //
+// NN buffer. Sparse matrices collect their nonzeros per chunk in pass 2.      //
+static bool loadText(const MappedFile& f, Matrix& A, Matrix& B, int& N, ThreadPool* pool) { // Parallel text loader.
+    const char* p = f.data();                                                   // Parse position.
+    const char* end = p + f.size();                                             // End of the file.
+    while (p < end && isSpace(*p)) ++p;                                         // Skip leading whitespace.
+    long long n;                                                                // Read N as a wide value first.
+    if (p == end || !parseValue(p, end, n) || n <= 0 || n > INT_MAX) {          // Read N and validate it is positive.
         cout << "Invalid N.\n";                                                 // Inform invalid size.
         return false;                                                           // Signal failure.
     }
+    N = (int)n;                                                                 // Dimension of both matrices.
+    const size_t perMatrix = (size_t)N * N, total = 2 * perMatrix;              // Values needed for A, and for both.
 
-    A.assign(N, vector<long long>(N, 0));                                       // Resize A to NN and fill with zeros.
-    B.assign(N, vector<long long>(N, 0));                                       // Resize B to NN and fill with zeros.
+    size_t len = end - p;                                                       // Bytes left to parse.
+    size_t want = max<size_t>(64, pool ? pool->size() * 4 : 1);                 // Enough chunks to tell A from B apart.
+    int chunks = (int)min<size_t>(want, max<size_t>(1, len >> 14));             // At least 16 KB each; tiny files: one.
+    vector<const char*> bound(chunks + 1);                                      // Chunk c is [bound[c], bound[c+1]).
+    bound[0] = p;                                                               // First chunk starts right after N.
+    bound[chunks] = end;                                                        // Last chunk ends with the file.
+    for (int c = 1; c < chunks; c++) {                                          // Place the inner boundaries.
+        const char* b = max(bound[c - 1], p + len / chunks * c);                // Evenly spaced guess.
+        while (b < end && !isSpace(b[-1])) ++b;                                 // Never cut a token in two.
+        bound[c] = b;                                                           // Boundary follows whitespace.
+    }
 
-    for (int i = 0; i < N; i++)                                                 // Loop over rows of A.
-        for (int j = 0; j < N; j++)                                             // Loop over columns of A.
-            if (!(fin >> A[i][j])) {                                            // Try to read next number for A.
-                cout << "Not enough numbers for A.\n";                          // If missing, report error.
-                return false;                                                   // Signal failure.
-            }
+    vector<size_t> first(chunks + 1, 0);                                        // Index of the first value of each chunk.
+    vector<size_t> zeros(chunks, 0);                                            // Zero tokens in each chunk.
+    forEachTask(pool, chunks, [&](int c) {                                      // Pass 1: count tokens.
+        first[c + 1] = countTokens(bound[c], bound[c + 1], zeros[c]);           // Tokens that start in chunk c.
+    });
+    for (int c = 0; c < chunks; c++) first[c + 1] += first[c];                  // Prefix sums give start indices.
+
+    double nonzero[2] = {0, 0};                                                 // Estimated nonzeros of A and B.
+    for (int c = 0; c < chunks; c++) {                                          // A chunk that straddles A and B
+        size_t a = first[c], b = first[c + 1];                                  // counts for both in proportion.
+        if (a == b) continue;                                                   // No tokens.
+        double share = (double)(b - a - zeros[c]) / (double)(b - a);            // Nonzero fraction of the chunk.
+        auto overlap = [&](size_t lo, size_t hi) {                              // Tokens of the chunk in [lo, hi).
+            size_t s = max(a, lo), e = min(b, hi);                              // ...
+            return e > s ? (double)(e - s) : 0.0;                               // ...
+        };
+        nonzero[0] += share * overlap(0, perMatrix);                            // Part that lands in A.
+        nonzero[1] += share * overlap(perMatrix, total);                        // Part that lands in B.
+    }
+    Matrix* mats[2] = {&A, &B};                                                 // Destinations, in file order.
+    bool sparse[2];                                                             // Storage chosen for each.
+    for (int m = 0; m < 2; m++) {                                               // Decide before allocating.
+        sparse[m] = Matrix::preferSparse((size_t)nonzero[m], N);                // Mostly zeros?
+        if (!sparse[m]) mats[m]->reset(N);                                      // Resize to NN and fill with zeros.
+    }
+    vector<FoundEntries> found(2 * (size_t)chunks);                             // Entry m*chunks+c: matrix m, chunk c.
 
-    for (int i = 0; i < N; i++)                                                 // Loop over rows of B.
-        for (int j = 0; j < N; j++)                                             // Loop over columns of B.
-            if (!(fin >> B[i][j])) {                                            // Try to read next number for B.
-                cout << "Not enough numbers for B.\n";                          // If missing, report error.
-                return false;                                                   // Signal failure.
+    vector<size_t> stop(chunks, SIZE_MAX);                                      // Index of a bad value, per chunk.
+    forEachTask(pool, chunks, [&](int c) {                                      // Pass 2: parse and store.
+        size_t idx = first[c];                                                  // Value index of the next token.
+        if (idx >= total) return;                                               // Extra numbers are ignored.
+        int m = idx < perMatrix ? 0 : 1;                                        // Matrix the chunk starts in.
+        size_t local = idx - m * perMatrix;                                     // Position inside that matrix.
+        int r = (int)(local / N), col = (int)(local % N);                       // Current cell.
+        long long* row = sparse[m] ? nullptr : mats[m]->row(r);                 // Dense destination row, if any.
+        FoundEntries* out = &found[m * (size_t)chunks + c];                     // Sparse destination.
+        const char* q = bound[c];                                               // Parse position in this chunk.
+        const char* e = bound[c + 1];                                           // End of this chunk.
+        while (idx < total) {                                                   // Stop once both matrices are full.
+            while (q < e && isSpace(*q)) ++q;                                   // Skip whitespace.
+            if (q == e) return;                                                 // Chunk done.
+            long long v;                                                        // Parsed value.
+            if (!parseValue(q, e, v)) { stop[c] = idx; return; }                // Not a number: stop here.
+            if (row) row[col] = v;                                              // Store it (dense),
+            else if (v != 0) {                                                  // or remember a nonzero (sparse).
+                out->idx.push_back((u64)r * N + col);                           // ...
+                out->val.push_back(v);                                          // ...
             }
+            idx++;                                                              // Next value index.
+            if (q < e && !isSpace(*q)) { stop[c] = idx; return; }               // "12abc": the next read fails.
+            if (++col == N) {                                                   // Row finished.
+                col = 0;                                                        // Back to column 0.
+                if (++r == N) {                                                 // Matrix finished.
+                    if (m == 1) return;                                         // B full: nothing more to read.
+                    m = 1;                                                      // Continue with B.
+                    r = 0;                                                      // From its first row.
+                    out = &found[chunks + (size_t)c];                           // B's entries for this chunk.
+                }
+                row = sparse[m] ? nullptr : mats[m]->row(r);                    // Pointer to the new row.
+            }
+        }
+    });
+
+    size_t good = first[chunks];                                                // Values read before the first problem.
+    for (int c = 0; c < chunks; c++) good = min(good, stop[c]);                 // Earliest bad value wins.
+    if (good < perMatrix) {                                                     // A could not be filled.
+        cout << "Not enough numbers for A.\n";                                  // If missing, report error.
+        return false;                                                           // Signal failure.
+    }
+    if (good < total) {                                                         // B could not be filled.
+        cout << "Not enough numbers for B.\n";                                  // If missing, report error.
+        return false;                                                           // Signal failure.
+    }
+    for (int m = 0; m < 2; m++) {                                               // Assemble the sparse matrices.
+        if (!sparse[m]) continue;                                               // Dense ones are already filled.
+        *mats[m] = gatherCsr(N, &found[m * (size_t)chunks], chunks, pool);      // CSR from the chunk lists.
+        if (!Matrix::preferSparse(mats[m]->nnz(), N)) mats[m]->toDense();       // The estimate was too low.
+    }
+    return true;                                                                // Successfully loaded both matrices.
+}
 
+// Loads N and then two NN matrices from a text or binary file.                //
+// A, B and N are only replaced if the whole file loads successfully.           //
+bool loadMatrices(const string& filename, Matrix& A, Matrix& B, int& N, ThreadPool* pool = nullptr) { // Function to read matrices from file.
+    OpTimer timer("load");                                                      // For --stats.
+    auto f = make_shared<MappedFile>();                                         // Shared so mapped matrices can keep it.
+    bool binary = false;                                                        // Decided by the file's first bytes.
+    if (f->open(filename, false)) {                                             // Peek with a read-only view.
+        binary = f->size() >= sizeof(BinaryHeader) && memcmp(f->data(), kBinaryMagic, sizeof kBinaryMagic) == 0; // Magic?
+        if (binary) {                                                           // Binary files become storage,
+            f = make_shared<MappedFile>();                                      // so remap them copy-on-write.
+            if (!f->open(filename, true)) f.reset();                            // Vanished in between?
+        }
+    } else {                                                                    // Could not open it at all.
+        f.reset();                                                              // Same handling as below.
+    }
+    if (!f) {                                                                   // Check if the file failed to open.
+        cout << "Error opening file.\n";                                        // Inform the user about the issue.
+        return false;                                                           // Signal failure.
+    }
+    Matrix newA, newB;                                                          // Load into temporaries first.
+    int newN = 0;                                                               // Dimension being loaded.
+    bool ok = binary ? loadBinary(f, newA, newB, newN, pool)                    // Zero-copy binary container,
+                     : loadText(*f, newA, newB, newN, pool);                    // or the parallel text parser.
+    if (!ok) return false;                                                      // Keep the old matrices on failure.
+    A = move(newA);                                                             // Commit the new matrices.
+    B = move(newB);                                                             // ...
+    N = newN;                                                                   // And their dimension.
     return true;                                                                // Successfully loaded both matrices.
 }
 
+// Reusable output buffer: values are formatted straight into one large         //
+// block with to_chars, which is handed to the stream in a few big writes.      //
+class OutBuffer {                                                               // Replaces per-value 'cout << setw(6)'.
+public:                                                                         // Public interface.
+    explicit OutBuffer(ostream& os) : os_(os) {                                 // Bind to a destination stream.
+        if (buf_.empty()) buf_.resize(1 << 20);                                 // 1 MB, allocated once per program.
+    }
+    ~OutBuffer() { flush(); }                                                   // Never lose buffered text.
+
+    void put(const char* s, size_t n) {                                         // Append raw bytes.
+        if (len_ + n > buf_.size()) flush();                                    // Make room first.
+        if (n > buf_.size()) { os_.write(s, n); return; }                       // Huge pieces bypass the buffer.
+        memcpy(&buf_[len_], s, n);                                              // Copy into the buffer.
+        len_ += n;                                                              // Grow the used part.
+    }
+    void put(const string& s) { put(s.data(), s.size()); }                      // Append a string.
+    void put(char c) { put(&c, 1); }                                            // Append one character.
+
+    // Appends v right-aligned in 'width' columns (like setw(width)).           //
+    void putValue(long long v, int width) {                                     // Fast integer formatting.
+        if (len_ + 32 > buf_.size()) flush();                                   // Longest value + padding fits in 32.
+        char tmp[24];                                                           // Digits of v.
+        int n = (int)(to_chars(tmp, tmp + sizeof tmp, v).ptr - tmp);            // No locale, no stream state.
+        for (int k = n; k < width; k++) buf_[len_++] = ' ';                     // Left padding.
+        memcpy(&buf_[len_], tmp, n);                                            // The digits.
+        len_ += n;                                                              // Grow the used part.
+    }
+
+    void flush() {                                                              // Hand everything to the stream.
+        if (len_ > 0) os_.write(buf_.data(), len_);                             // One big write.
+        len_ = 0;                                                               // Buffer is empty again.
+    }
+
+private:                                                                        // Buffer state.
+    static vector<char> buf_;                                                   // Shared block, reused by every print.
+    ostream& os_;                                                               // Destination.
+    size_t len_ = 0;                                                            // Bytes currently buffered.
+};
+vector<char> OutBuffer::buf_;                                                   // Storage for the shared block.
+
 // Prints a matrix with aligned columns and an optional title.                  //
-void printMatrix(const Matrix& M, const string& title) {                         // Function to print matrix M.
-    if (!title.empty()) cout << title << "\n";                                  // If a title is given, print it first.
-    int N = (int)M.size();                                                      // Get the matrix dimension N.
+void printMatrix(const Matrix& M, const string& title, ostream& os = cout) {    // Function to print matrix M.
+    OutBuffer out(os);                                                          // Formats into the shared buffer.
+    if (!title.empty()) { out.put(title); out.put('\n'); }                      // If a title is given, print it first.
+    int N = M.size();                                                           // Get the matrix dimension N.
+    vector<long long> scratch;                                                  // Expanded row of a sparse matrix.
     for (int i = 0; i < N; i++) {                                               // Iterate over rows.
+        const long long* r = M.rowData(i, scratch);                             // Row i, dense or sparse.
         for (int j = 0; j < N; j++)                                             // Iterate over columns.
-            cout << setw(6) << M[i][j];                                         // Print each value right-aligned width 6.
-        cout << "\n";                                                           // End the current row with newline.
+            out.putValue(r[j], 6);                                              // Print each value right-aligned width 6.
+        out.put('\n');                                                          // End the current row with newline.
+    }
+}
+
+// Writes a matrix as CSV: a '# title' comment line, then one line per row.     //
+void writeCsv(const Matrix& M, const string& title, ostream& os) {              // Machine-readable text output.
+    OutBuffer out(os);                                                          // Same fast formatting path.
+    if (!title.empty()) { out.put("# "); out.put(title); out.put('\n'); }       // Label the block.
+    int N = M.size();                                                           // Matrix dimension.
+    vector<long long> scratch;                                                  // Expanded row of a sparse matrix.
+    for (int i = 0; i < N; i++) {                                               // Each row.
+        const long long* r = M.rowData(i, scratch);                             // Row i, dense or sparse.
+        for (int j = 0; j < N; j++) {                                           // Each column.
+            if (j > 0) out.put(',');                                            // Separator.
+            out.putValue(r[j], 0);                                              // No padding in CSV.
+        }
+        out.put('\n');                                                          // End of row.
+    }
+}
+
+// Where printed matrices go: pretty text on stdout (default), nowhere          //
+// (--quiet), or appended to a file as CSV or binary containers (--output).     //
+enum class OutputFormat { Text, None, Csv, Binary };                            // Selected by command-line options.
+
+class ResultWriter {                                                            // Used by main() for every printed matrix.
+public:                                                                         // Public interface.
+    // Selects the format; Csv and Binary also (re)create 'path'.               //
+    bool open(OutputFormat format, const string& path) {                        // False if the file cannot be created.
+        format_ = format;                                                       // Remember the format.
+        if (format == OutputFormat::Csv || format == OutputFormat::Binary) {    // File-based formats.
+            file_.open(path, format == OutputFormat::Binary ? ios::binary | ios::out : ios::out); // Truncate it.
+            if (!file_) return false;                                           // Could not create it.
+        }
+        return true;                                                            // Ready.
+    }
+
+    void write(const Matrix& M, const string& title) {                          // Emits one matrix.
+        if (format_ == OutputFormat::None) return;                              // --quiet: skip it.
+        OpTimer timer("print");                                                 // For --stats.
+        switch (format_) {                                                      // Pick the output path.
+        case OutputFormat::Text: printMatrix(M, title); break;                  // Pretty-print to stdout.
+        case OutputFormat::None: break;                                         // Handled above.
+        case OutputFormat::Csv: writeCsv(M, title, file_); break;               // Stream CSV to the file.
+        case OutputFormat::Binary: {                                            // One container per matrix.
+            const Matrix* one[1] = {&M};                                        // Single-matrix container.
+            writeBinary(file_, one, 1);                                         // Appended to the file.
+            break;                                                              // Done.
+        }
+        }
+        if (file_.is_open()) file_.flush();                                     // Results are visible right away.
+    }
+
+private:                                                                        // Writer state.
+    OutputFormat format_ = OutputFormat::Text;                                  // Current format.
+    ofstream file_;                                                             // Destination for Csv and Binary.
+};
+
+// ---- Sparse (CSR) kernels -------------------------------------------------  //
+// Used by add(), multiply() and the column edits whenever an operand is        //
+// sparse. Sparse-only operations produce CSR results (switched to dense        //
+// when they fill in past Matrix::preferSparse); mixed ones produce dense       //
+// results, since a dense operand already makes the result mostly nonzero.      //
+// Arithmetic wraps around like the dense kernels.                              //
+namespace sparse {
+// Stored entries of row i, columns increasing.                                 //
+struct Row {                                                                    // Read-only view of a CSR row.
+    const int* col;                                                             // Columns.
+    const long long* val;                                                       // Values.
+    int len;                                                                    // Entry count.
+};
+static Row row(const Matrix& M, int i) { return {M.rowCols(i), M.rowVals(i), M.rowNnz(i)}; } // Row i of M.
+
+// Wraps finished CSR arrays, switching to dense storage if too full.           //
+static Matrix finish(int N, vector<int64_t>& rowPtr, vector<int>& cols, vector<long long>& vals) { // Result helper.
+    Matrix C = Matrix::fromCsr(N, move(rowPtr), move(cols), move(vals));        // Take over the arrays.
+    if (!Matrix::preferSparse(C.nnz(), N)) C.toDense();                         // Dense is smaller and faster now.
+    return C;                                                                   // Moved out.
+}
+
+// Two-pass row-parallel construction: count(i) gives the number of entries     //
+// of row i, fill(i, cols, vals) writes exactly that many.                      //
+static Matrix build(int N, ThreadPool* pool, const function<int(int)>& count,   // Shared by add and multiply.
+                    const function<void(int, int*, long long*)>& fill) {        // ...
+    vector<int64_t> rowPtr(N + 1, 0);                                           // Row starts.
+    forEachRowRange(pool, N, [&](int i0, int i1) {                              // Pass 1: sizes.
+        for (int i = i0; i < i1; i++) rowPtr[i + 1] = count(i);                 // Entries of row i.
+    });
+    for (int i = 0; i < N; i++) rowPtr[i + 1] += rowPtr[i];                     // Prefix sums give row starts.
+    vector<int> cols(rowPtr[N]);                                                // Exact sizes, one allocation each.
+    vector<long long> vals(rowPtr[N]);                                          // ...
+    forEachRowRange(pool, N, [&](int i0, int i1) {                              // Pass 2: entries.
+        for (int i = i0; i < i1; i++) fill(i, cols.data() + rowPtr[i], vals.data() + rowPtr[i]); // Row i in its slot.
+    });
+    return finish(N, rowPtr, cols, vals);                                       // Sparse or dense result.
+}
+
+// A + B with at least one sparse operand.                                      //
+static Matrix add(const Matrix& A, const Matrix& B, int N, ThreadPool* pool) {  // Called by ::add().
+    if (A.isSparse() && B.isSparse()) {                                         // Merge the rows.
+        auto count = [&](int i) {                                               // Size of the union of columns.
+            Row a = row(A, i), b = row(B, i);                                   // Both rows.
+            int n = 0, x = 0, y = 0;                                            // Entries, positions.
+            while (x < a.len || y < b.len) {                                    // Standard merge.
+                if (y == b.len || (x < a.len && a.col[x] < b.col[y])) x++;      // Only in A.
+                else if (x == a.len || b.col[y] < a.col[x]) y++;                // Only in B.
+                else { x++; y++; }                                              // In both.
+                n++;                                                            // One output entry.
+            }
+            return n;                                                           // ...
+        };
+        auto fill = [&](int i, int* c, long long* v) {                          // Same merge, writing values.
+            Row a = row(A, i), b = row(B, i);                                   // Both rows.
+            int x = 0, y = 0;                                                   // Positions.
+            while (x < a.len || y < b.len) {                                    // ...
+                if (y == b.len || (x < a.len && a.col[x] < b.col[y])) { *c = a.col[x]; *v = a.val[x++]; } // ...
+                else if (x == a.len || b.col[y] < a.col[x]) { *c = b.col[y]; *v = b.val[y++]; } // ...
+                else { *c = a.col[x]; *v = (long long)((u64)a.val[x++] + (u64)b.val[y++]); } // ...
+                c++, v++;                                                       // Next output slot.
+            }
+        };
+        return build(N, pool, count, fill);                                     // CSR (or dense) sum.
+    }
+    const Matrix& D = A.isSparse() ? B : A;                                     // Dense operand.
+    const Matrix& S = A.isSparse() ? A : B;                                     // Sparse operand.
+    Matrix C(N);                                                                // Dense result.
+    forEachRowRange(pool, N, [&](int i0, int i1) {                              // Rows are independent.
+        for (int i = i0; i < i1; i++) {                                         // Each row.
+            long long* c = C.row(i);                                            // Row i of the result.
+            memcpy(c, D.row(i), (size_t)N * sizeof(long long));                 // Start from the dense row.
+            Row s = row(S, i);                                                  // Then add the stored entries.
+            for (int k = 0; k < s.len; k++) c[s.col[k]] = (long long)((u64)c[s.col[k]] + (u64)s.val[k]); // ...
+        }
+    });
+    return C;                                                                   // Dense sum.
+}
+
+// A * B with at least one sparse operand. Sparse  sparse is Gustavson's       //
+// row-by-row algorithm: row i of C combines the rows of B selected by row i    //
+// of A, gathered in a per-thread accumulator of N values.                      //
+static Matrix multiply(const Matrix& A, const Matrix& B, int N, ThreadPool* pool) { // Called by ::multiply().
+    if (A.isSparse() && B.isSparse()) {                                         // Result stays sparse if it can.
+        struct Acc {                                                            // Per-thread scratch.
+            vector<u64> sum;                                                    // Partial sums by column.
+            vector<u64> mark;                                                   // Column is in 'list' if mark == stamp.
+            vector<int> list;                                                   // Columns touched by this row.
+            u64 stamp = 0;                                                      // Changes for every row.
+        };
+        auto gather = [&](int i) -> Acc& {                                      // Columns and sums of row i of C.
+            thread_local Acc acc;                                               // Reused across rows and calls.
+            if ((int)acc.mark.size() < N) { acc.sum.resize(N); acc.mark.assign(N, 0); } // Large enough for N columns.
+            acc.stamp++;                                                        // Invalidates all old marks at once.
+            acc.list.clear();                                                   // No columns yet.
+            Row a = row(A, i);                                                  // Row i of A.
+            for (int x = 0; x < a.len; x++) {                                   // Each A(i, k) != 0...
+                Row b = row(B, a.col[x]);                                       // ...selects row k of B.
+                for (int y = 0; y < b.len; y++) {                               // Each B(k, j).
+                    int j = b.col[y];                                           // Output column.
+                    u64 t = (u64)a.val[x] * (u64)b.val[y];                      // Contribution.
+                    if (acc.mark[j] != acc.stamp) {                             // First time in this row:
+                        acc.mark[j] = acc.stamp;                                // remember the column,
+                        acc.list.push_back(j);                                  // ...
+                        acc.sum[j] = t;                                         // and start its sum.
+                    } else {                                                    // Seen before:
+                        acc.sum[j] += t;                                        // accumulate.
+                    }
+                }
+            }
+            return acc;                                                         // Valid until the next row.
+        };
+        auto count = [&](int i) { return (int)gather(i).list.size(); };         // Pass 1: structure only.
+        auto fill = [&](int i, int* c, long long* v) {                          // Pass 2: same work, with values.
+            Acc& acc = gather(i);                                               // Row i of C.
+            sort(acc.list.begin(), acc.list.end());                             // CSR wants increasing columns.
+            for (size_t k = 0; k < acc.list.size(); k++) {                      // Copy out.
+                c[k] = acc.list[k];                                             // ...
+                v[k] = (long long)acc.sum[acc.list[k]];                         // ...
+            }
+        };
+        return build(N, pool, count, fill);                                     // CSR (or dense) product.
     }
+    Matrix C(N);                                                                // Mixed: dense result.
+    forEachRowRange(pool, N, [&](int i0, int i1) {                              // Rows are independent.
+        for (int i = i0; i < i1; i++) {                                         // Each row of C.
+            u64* c = (u64*)C.row(i);                                            // Row i of the result.
+            if (A.isSparse()) {                                                 // Sparse  dense:
+                Row a = row(A, i);                                              // row i of C = sum of A(i,k) *
+                for (int x = 0; x < a.len; x++) {                               // row k of B.
+                    const u64* b = (const u64*)B.row(a.col[x]);                 // ...
+                    u64 s = (u64)a.val[x];                                      // ...
+                    for (int j = 0; j < N; j++) c[j] += s * b[j];               // Contiguous; vectorizes.
+                }
+            } else {                                                            // Dense  sparse:
+                const long long* a = A.row(i);                                  // same, with B's rows sparse.
+                for (int k = 0; k < N; k++) {                                   // ...
+                    if (a[k] == 0) continue;                                    // Nothing to add.
+                    Row b = row(B, k);                                          // ...
+                    for (int y = 0; y < b.len; y++) c[b.col[y]] += (u64)a[k] * (u64)b.val[y]; // ...
+                }
+            }
+        }
+    });
+    return C;                                                                   // Dense product.
+}
+
+// Swaps columns c1 and c2 of a sparse matrix. In each row that holds only      //
+// one of them, that entry moves to its new sorted position.                    //
+static void swapCols(Matrix& M, int N, int c1, int c2, ThreadPool* pool) {      // Called by ::swapCols().
+    forEachRowRange(pool, N, [&](int i0, int i1) {                              // Rows are independent.
+        for (int i = i0; i < i1; i++) {                                         // Each row.
+            int* col = M.rowCols(i);                                            // Its columns...
+            long long* val = M.rowVals(i);                                      // ...and values.
+            int len = M.rowNnz(i);                                              // ...
+            int p1 = (int)(lower_bound(col, col + len, c1) - col);              // Where c1 is or would be.
+            int p2 = (int)(lower_bound(col, col + len, c2) - col);              // Same for c2.
+            bool has1 = p1 < len && col[p1] == c1, has2 = p2 < len && col[p2] == c2; // Stored?
+            if (has1 && has2) { swap(val[p1], val[p2]); continue; }             // Both: swap the values.
+            if (!has1 && !has2) continue;                                       // Neither: row unchanged.
+            int from = has1 ? p1 : p2, to = has1 ? p2 : p1;                     // Entry to move, target slot.
+            col[from] = has1 ? c2 : c1;                                         // It now belongs to the other column.
+            if (to > from) {                                                    // Move right: slots from+1..to-1
+                rotate(col + from, col + from + 1, col + to);                   // shift left by one.
+                rotate(val + from, val + from + 1, val + to);                   // ...
+            } else {                                                            // Move left: slots to..from-1
+                rotate(col + to, col + from, col + from + 1);                   // shift right by one.
+                rotate(val + to, val + from, val + from + 1);                   // ...
+            }
+        }
+    });
+}
+
+// Reorders the columns of a sparse matrix: new column j is old order[j].       //
+static void permuteCols(Matrix& M, int N, const vector<int>& order, ThreadPool* pool) { // Called by ::permuteCols().
+    vector<int> where(N);                                                       // Old column -> new column.
+    for (int j = 0; j < N; j++) where[order[j]] = j;                            // Inverse permutation.
+    forEachRowRange(pool, N, [&](int i0, int i1) {                              // Rows are independent.
+        thread_local vector<pair<int, long long>> tmp;                          // Entries of one row.
+        for (int i = i0; i < i1; i++) {                                         // Each row.
+            int* col = M.rowCols(i);                                            // ...
+            long long* val = M.rowVals(i);                                      // ...
+            int len = M.rowNnz(i);                                              // ...
+            tmp.resize(len);                                                    // Relabel the columns,
+            for (int k = 0; k < len; k++) tmp[k] = {where[col[k]], val[k]};     // ...
+            sort(tmp.begin(), tmp.end());                                       // then restore column order.
+            for (int k = 0; k < len; k++) { col[k] = tmp[k].first; val[k] = tmp[k].second; } // ...
+        }
+    });
 }
+}  // namespace sparse
 
 // Returns the sum A + B into a new matrix C (size NN).                        //
-Matrix add(const Matrix& A, const Matrix& B, int N) {                            // Function to add two matrices.
-    Matrix C(N, vector<long long>(N, 0));                                       // Prepare result matrix C filled with 0.
-    for (int i = 0; i < N; i++)                                                 // Loop rows.
-        for (int j = 0; j < N; j++)                                             // Loop columns.
-            C[i][j] = A[i][j] + B[i][j];                                        // Element-wise addition.
+// With a pool, each task adds one range of rows (see forEachRowRange()).       //
+Matrix add(const Matrix& A, const Matrix& B, int N, ThreadPool* pool = nullptr) { // Function to add two matrices.
+    if (A.isSparse() || B.isSparse()) return sparse::add(A, B, N, pool);        // CSR kernels.
+    Matrix C(N);                                                                // Prepare result matrix C filled with 0.
+    forEachRowRange(pool, N, [&](int i0, int i1) {                              // Rows are independent.
+        for (int i = i0; i < i1; i++) {                                         // Loop rows.
+            const long long* a = A.row(i);                                      // Row i of A (follows A's row order).
+            const long long* b = B.row(i);                                      // Row i of B (follows B's row order).
+            long long* c = C.row(i);                                            // Row i of the result.
+            for (int j = 0; j < N; j++)                                         // Loop columns.
+                c[j] = (long long)((u64)a[j] + (u64)b[j]);                      // Element-wise addition (wraps).
+        }
+    });
     return C;                                                                   // Return the result matrix.
 }
 
+// ---- Tiled GEMM engine for long long matrices ------------------------------ //
+// The product is computed GotoBLAS-style: B is packed into KCNC panels        //
+// (sized for L2/L3), A into MCKC blocks (sized for L2), and a register-       //
+// blocked MRNR micro-kernel walks the packed data (one A/B sliver pair        //
+// fits in L1). All arithmetic is done on unsigned values, so overflow wraps    //
+// around exactly like the old triple loop and results match bit-for-bit.       //
+namespace gemm {                                                                // Keeps the tuning constants out of global scope.
+constexpr int MR = 4;                                                           // Rows of C computed per micro-kernel call.
+constexpr int NR = 8;                                                           // Columns of C computed per micro-kernel call.
+static_assert(NR == 8, "kernelScalar() keeps one named sum per column");        // Update it if NR changes.
+constexpr int KC = 256;                                                         // Depth of a packed sliver (MR*KC + KC*NR values fit L1).
+constexpr int MC = 128;                                                         // Rows of A packed at once (MC*KC values fit L2).
+constexpr int NC = 2048;                                                        // Columns of B packed at once (KC*NC values fit L3).
+
+// C[0..MR)[0..NR) += sum over k of a[k*MR + i] * b[k*NR + j].                  //
+using MicroKernel = void (*)(int kc, const u64* a, const u64* b, u64* c, size_t ldc); // ldc = C's row stride.
+
+// Portable fallback. One row of the tile at a time, with its NR sums in        //
+// named locals: an acc[MR][NR] array is too big for the general registers      //
+// and ends up in memory, which makes the loop no faster than a naive one.      //
+// Re-reading the B sliver per row is cheap, since it stays in L1.              //
+static void kernelScalar(int kc, const u64* a, const u64* b, u64* c, size_t ldc) { // Used on non-x86 or old CPUs.
+    for (int i = 0; i < MR; i++) {                                              // Each row of the tile.
+        u64 c0 = 0, c1 = 0, c2 = 0, c3 = 0, c4 = 0, c5 = 0, c6 = 0, c7 = 0;     // Row i of the tile (NR = 8).
+        const u64* pa = a + i;                                                  // A(i, k) lives at pa[k*MR].
+        const u64* pb = b;                                                      // B(k, 0..NR) at pb[k*NR].
+        for (int k = 0; k < kc; k++, pa += MR, pb += NR) {                      // Walk both slivers together.
+            u64 x = *pa;                                                        // One value of A...
+            c0 += x * pb[0]; c1 += x * pb[1]; c2 += x * pb[2]; c3 += x * pb[3]; // ...times a row of B
+            c4 += x * pb[4]; c5 += x * pb[5]; c6 += x * pb[6]; c7 += x * pb[7]; // (wraps mod 2^64).
+        }
+        u64* r = c + i * ldc;                                                   // Row i of C.
+        r[0] += c0; r[1] += c1; r[2] += c2; r[3] += c3;                         // Add into C.
+        r[4] += c4; r[5] += c5; r[6] += c6; r[7] += c7;                         // ...
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)                                    // SIMD variants exist only on x86.
+// AVX2 has no 64-bit multiply, so build it from three 32x32-bit products:      //
+// lo(a)*lo(b) + ((lo(a)*hi(b) + hi(a)*lo(b)) << 32), which is exact mod 2^64.  //
+__attribute__((target("avx2")))                                                 // Compile this helper for AVX2.
+static inline __m256i mul64Avx2(__m256i a, __m256i aHi, __m256i b) {            // aHi = a >> 32, precomputed by the caller.
+    __m256i bHi = _mm256_srli_epi64(b, 32);                                     // High halves of b.
+    __m256i lo = _mm256_mul_epu32(a, b);                                        // lo(a) * lo(b), full 64 bits.
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(a, bHi),                  // lo(a) * hi(b)
+                                     _mm256_mul_epu32(aHi, b));                 // + hi(a) * lo(b).
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));                  // Combine; the hi*hi term overflows away.
+}
+
+__attribute__((target("avx2")))                                                 // 48 tile held in 8 ymm registers.
+static void kernelAvx2(int kc, const u64* a, const u64* b, u64* c, size_t ldc) { // Chosen when the CPU has AVX2.
+    __m256i acc[MR][2];                                                         // Two 4-lane vectors per tile row.
+    for (int i = 0; i < MR; i++) acc[i][0] = acc[i][1] = _mm256_setzero_si256(); // Start from zero.
+    for (int k = 0; k < kc; k++, a += MR, b += NR) {                            // Walk both slivers together.
+        __m256i b0 = _mm256_loadu_si256((const __m256i*)b);                     // Columns 0..3 of this B row.
+        __m256i b1 = _mm256_loadu_si256((const __m256i*)(b + 4));               // Columns 4..7 of this B row.
+        for (int i = 0; i < MR; i++) {                                          // Unrolled by the compiler.
+            __m256i ai = _mm256_set1_epi64x((long long)a[i]);                   // Broadcast A[i][k].
+            __m256i aiHi = _mm256_srli_epi64(ai, 32);                           // Its high half, reused twice.
+            acc[i][0] = _mm256_add_epi64(acc[i][0], mul64Avx2(ai, aiHi, b0));   // Accumulate columns 0..3.
+            acc[i][1] = _mm256_add_epi64(acc[i][1], mul64Avx2(ai, aiHi, b1));   // Accumulate columns 4..7.
+        }
+    }
+    for (int i = 0; i < MR; i++) {                                              // Add the tile into C.
+        __m256i* ci = (__m256i*)(c + i * ldc);                                  // Row i of the C tile.
+        _mm256_storeu_si256(ci, _mm256_add_epi64(_mm256_loadu_si256(ci), acc[i][0])); // Columns 0..3.
+        _mm256_storeu_si256(ci + 1, _mm256_add_epi64(_mm256_loadu_si256(ci + 1), acc[i][1])); // Columns 4..7.
+    }
+}
+
+__attribute__((target("avx512f,avx512dq")))                                     // 48 tile held in 4 zmm registers.
+static void kernelAvx512(int kc, const u64* a, const u64* b, u64* c, size_t ldc) { // Chosen when the CPU has AVX-512DQ.
+    __m512i acc[MR];                                                            // One 8-lane vector per tile row.
+    for (int i = 0; i < MR; i++) acc[i] = _mm512_setzero_si512();               // Start from zero.
+    for (int k = 0; k < kc; k++, a += MR, b += NR) {                            // Walk both slivers together.
+        __m512i bk = _mm512_loadu_si512(b);                                     // All 8 columns of this B row.
+        for (int i = 0; i < MR; i++)                                            // Unrolled by the compiler.
+            acc[i] = _mm512_add_epi64(acc[i],                                   // Native 64-bit multiply (vpmullq).
+                _mm512_mullo_epi64(_mm512_set1_epi64((long long)a[i]), bk));    // A[i][k] * B[k][0..7].
+    }
+    for (int i = 0; i < MR; i++)                                                // Add the tile into C.
+        _mm512_storeu_si512(c + i * ldc, _mm512_add_epi64(_mm512_loadu_si512(c + i * ldc), acc[i])); // Row i.
+}
+#endif
+
+// Picks the widest micro-kernel this CPU supports (CPUID via the compiler).    //
+// MATRIX_OPS_KERNEL=scalar|avx2|avx512 forces a variant, e.g. for testing.     //
+static MicroKernel selectKernel() {                                             // Runs once during static initialization.
+    const char* force = getenv("MATRIX_OPS_KERNEL");                            // Optional override from the environment.
+    string want = force ? force : "";                                           // Empty means "auto".
+    if (want == "scalar") return kernelScalar;                                  // Forced portable path.
+#if defined(__x86_64__) || defined(__i386__)                                    // Only x86 has the SIMD variants.
+    __builtin_cpu_init();                                                       // Make sure CPUID data is available.
+    bool has512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"); // vpmullq needs DQ.
+    bool has2 = __builtin_cpu_supports("avx2");                                 // 256-bit integer ops.
+    if (has512 && (want.empty() || want == "avx512")) return kernelAvx512;      // Widest vectors first.
+    if (has2 && (want.empty() || want == "avx2" || want == "avx512")) return kernelAvx2; // Then AVX2.
+#endif
+    return kernelScalar;                                                        // Fallback that always works.
+}
+
+static const MicroKernel kernel = selectKernel();                               // Dispatch decision made at startup.
+
+// Where the kernels read operand rows from: a Matrix (which may have a row     //
+// permutation) or a plain strided block of memory such as a Strassen temp.     //
+struct RowSource {                                                              // Either m, or p with row pitch ld.
+    const Matrix* m;                                                            // Matrix to read, or null.
+    const u64* p;                                                               // Otherwise: first row of the block.
+    size_t ld;                                                                  // Otherwise: values between rows.
+    const u64* row(int i) const {                                               // Pointer to row i.
+        return m ? (const u64*)m->row(i) : p + (size_t)i * ld;                  // Resolved once per packed row.
+    }
+};
+static RowSource rows(const Matrix& M) { return {&M, nullptr, 0}; }             // Rows of a Matrix.
+static RowSource rows(const u64* p, size_t ld) { return {nullptr, p, ld}; }     // Rows of a strided block.
+
+// Copies rows [i0, i0+mc)  columns [p0, p0+kc) of A into MR-row slivers,      //
+// zero-padding the last sliver so the micro-kernel never needs bounds checks.  //
+static void packA(const RowSource& A, int i0, int mc, int p0, int kc, u64* dst) { // dst holds ceil(mc/MR)*MR*kc values.
+    for (int ir = 0; ir < mc; ir += MR) {                                       // One sliver of MR rows at a time.
+        const u64* rows[MR];                                                    // Source row pointers (or null for padding).
+        for (int i = 0; i < MR; i++)                                            // Resolve each row once.
+            rows[i] = ir + i < mc ? A.row(i0 + ir + i) + p0 : nullptr;          // Honors A's row permutation.
+        for (int k = 0; k < kc; k++)                                            // Interleave: column k of all MR rows.
+            for (int i = 0; i < MR; i++)                                        // Next to each other in memory.
+                *dst++ = rows[i] ? rows[i][k] : 0;                              // Zero where the sliver runs past mc.
+    }
+}
+
+// Copies rows [p0, p0+kc)  columns [j0, j0+nc) of B into NR-column slivers.   //
+static void packB(const RowSource& B, int p0, int kc, int j0, int nc, u64* dst) { // dst holds ceil(nc/NR)*NR*kc values.
+    for (int jr = 0; jr < nc; jr += NR) {                                       // One sliver of NR columns at a time.
+        int w = min(NR, nc - jr);                                               // Real columns in this sliver.
+        for (int k = 0; k < kc; k++) {                                          // Row k of the sliver.
+            const u64* src = B.row(p0 + k) + j0 + jr;                           // Contiguous run inside row p0+k of B.
+            for (int j = 0; j < w; j++) dst[j] = src[j];                        // Copy the real columns.
+            for (int j = w; j < NR; j++) dst[j] = 0;                            // Zero-pad past the right edge.
+            dst += NR;                                                          // Next packed row.
+        }
+    }
+}
+
+// Accumulates C[i0..i1)[j0..j1) += A[i0..i1)[0..K) * B[0..K)[j0..j1), where    //
+// C is a strided block with ldc values between rows.                           //
+static void gemmBlock(const RowSource& A, const RowSource& B, int K,            // Computes one rectangle of C.
+                      u64* C, size_t ldc, int i0, int i1, int j0, int j1) {     // Half-open row/column ranges.
+    thread_local vector<u64> bufA, bufB;                                        // Per-thread packing buffers, reused.
+    size_t needA = (size_t)(MC + MR) * KC;                                      // Packed A block (rounded up to MR rows).
+    size_t needB = (size_t)(min(NC, j1 - j0) + NR) * KC;                        // Packed B panel (rounded up to NR cols).
+    if (bufA.size() < needA) bufA.resize(needA);                                // Grow only when needed.
+    if (bufB.size() < needB) bufB.resize(needB);                                // Same for B.
+    u64 edge[MR * NR];                                                          // Scratch tile for partial edge tiles.
+    for (int jc = j0; jc < j1; jc += NC) {                                      // Panel of columns of B and C.
+        int nc = min(NC, j1 - jc);                                              // Columns in this panel.
+        for (int pc = 0; pc < K; pc += KC) {                                    // Slice of the shared dimension.
+            int kc = min(KC, K - pc);                                           // Depth of this slice.
+            packB(B, pc, kc, jc, nc, bufB.data());                              // Pack once, reuse for every row block.
+            for (int ic = i0; ic < i1; ic += MC) {                              // Block of rows of A and C.
+                int mc = min(MC, i1 - ic);                                      // Rows in this block.
+                packA(A, ic, mc, pc, kc, bufA.data());                          // Pack the A block for this slice.
+                for (int jr = 0; jr < nc; jr += NR) {                           // Micro-panel of NR columns.
+                    const u64* bp = bufB.data() + (size_t)(jr / NR) * NR * kc;  // Its packed B sliver.
+                    int nr = min(NR, nc - jr);                                  // Real columns in the tile.
+                    for (int ir = 0; ir < mc; ir += MR) {                       // Micro-panel of MR rows.
+                        const u64* ap = bufA.data() + (size_t)(ir / MR) * MR * kc; // Its packed A sliver.
+                        int mr = min(MR, mc - ir);                              // Real rows in the tile.
+                        u64* c = C + (size_t)(ic + ir) * ldc + jc + jr;         // Top-left of the C tile.
+                        if (mr == MR && nr == NR) {                             // Full tile: write straight into C.
+                            kernel(kc, ap, bp, c, ldc);                         // C rows are evenly spaced.
+                            continue;                                           // Next tile.
+                        }
+                        memset(edge, 0, sizeof edge);                           // Partial tile: compute into scratch.
+                        kernel(kc, ap, bp, edge, NR);                           // Padding lanes multiply zeros.
+                        for (int i = 0; i < mr; i++)                            // Copy back only the real part.
+                            for (int j = 0; j < nr; j++)                        // Column by column.
+                                c[i * ldc + j] += edge[i * NR + j];             // Accumulate into C.
+                    }
+                }
+            }
+        }
+    }
+}
+
+// C += A * B for an nn block C (row pitch ldc). With a pool, C is cut into    //
+// a fixed grid of 2D tiles, one task per tile; the grid does not depend on     //
+// the thread count.                                                            //
+static void gemmTiled(const RowSource& A, const RowSource& B, u64* C, size_t ldc, int n, // The classic O(n^3) product.
+                      ThreadPool* pool) {                                       // Optional worker pool.
+    const int TM = 2 * MC, TN = 512;                                            // Tile height/width in elements of C.
+    int tilesI = (n + TM - 1) / TM, tilesJ = (n + TN - 1) / TN;                 // Grid dimensions.
+    forEachTask(pool, tilesI * tilesJ, [&](int t) {                             // Tiles are independent.
+        int i0 = (t / tilesJ) * TM, j0 = (t % tilesJ) * TN;                     // Top-left corner of the tile.
+        gemmBlock(A, B, n, C, ldc, i0, min(n, i0 + TM), j0, min(n, j0 + TN));   // Blocked, vectorized kernel.
+    });
+}
+}  // namespace gemm
+
+// ---- Strassen-Winograd multiplication ------------------------------------------//
+// For large N, multiply() recurses with Winograd's variant of Strassen (7      //
+// half-size products and 15 additions per level) down to blocks of at most     //
+// 'cutoff', which go to the classic kernel. The ring of 64-bit integers        //
+// modulo 2^64 makes every step exact, so results match the classic kernel      //
+// bit-for-bit. N is padded with zeros to m*2^d (m <= cutoff), and all          //
+// temporaries come from one arena allocated per product. With a pool, the      //
+// 7 top-level products run as tasks (the levels below them are serial).        //
+namespace strassen {                                                            // Keeps the helpers out of global scope.
+int cutoff = -1;                                                                // Largest leaf size; -1 = calibrate (prepare).
+static int measured = INT_MAX;                                                  // Calibrated leaf size, INT_MAX = classic.
+static bool calibrated = false;                                                 // prepare() measured already?
+constexpr int kTasks = 7;                                                       // Parallel products per product.
+constexpr int kCalibrationSize = 1024;                                          // Size calibrate() measures at.
+
+// Bump allocator for the recursion: one allocation up front, then blocks       //
+// are handed out and given back in stack order with mark()/release().          //
+class Arena {                                                                   // No malloc inside the recursion.
+public:                                                                         // Public interface.
+    explicit Arena(size_t words) : buf_(words) {}                               // The single allocation.
+    u64* alloc(size_t words) {                                                  // Next free block.
+        u64* p = buf_.data() + top_;                                            // Start of the block.
+        top_ += (words + 7) & ~(size_t)7;                                       // Keep blocks 64-byte multiples.
+        return p;                                                               // Caller fills it.
+    }
+    size_t mark() const { return top_; }                                        // Current top of the stack.
+    void release(size_t m) { top_ = m; }                                        // Free everything after mark m.
+private:                                                                        // Arena state.
+    vector<u64> buf_;                                                           // Backing storage.
+    size_t top_ = 0;                                                            // First free word.
+};
+
+struct View {                                                                   // Square block inside a bigger buffer.
+    u64* p;                                                                     // Top-left element.
+    size_t ld;                                                                  // Values between rows.
+    u64* row(int i) const { return p + (size_t)i * ld; }                        // Row i of the block.
+    View quad(int h, int qi, int qj) const {                                    // Quadrant (qi, qj) of half-size h.
+        return {p + (size_t)qi * h * ld + (size_t)qj * h, ld};                  // Same row pitch.
+    }
+};
+
+// dst = x + sign*y over nn blocks, in parallel for large blocks.              //
+static void addSub(View dst, View x, View y, int n, bool subtract, ThreadPool* pool) { // One of the 15 additions.
+    forEachRowRange(n >= 512 ? pool : nullptr, n, [&](int i0, int i1) {         // Small: inline.
+        for (int i = i0; i < i1; i++) {                                         // Each row in the range.
+            u64* d = dst.row(i);                                                // Output row.
+            const u64* a = x.row(i);                                            // First operand row.
+            const u64* b = y.row(i);                                            // Second operand row.
+            if (subtract) for (int j = 0; j < n; j++) d[j] = a[j] - b[j];       // Wraps mod 2^64.
+            else for (int j = 0; j < n; j++) d[j] = a[j] + b[j];                // Wraps mod 2^64.
+        }
+    });
+}
+static void add(View d, View x, View y, int n, ThreadPool* pool) { addSub(d, x, y, n, false, pool); } // d = x + y.
+static void sub(View d, View x, View y, int n, ThreadPool* pool) { addSub(d, x, y, n, true, pool); } // d = x - y.
+
+// C = A * B for nn blocks (C is overwritten). Uses three half-size temps      //
+// per level (X, Y, Z); the quadrants of C hold the other partial products.     //
+static void winograd(View C, View A, View B, int n, int leaf, Arena& arena, ThreadPool* pool) { // The recursion.
+    if (n <= leaf) {                                                            // Small enough: classic kernel.
+        for (int i = 0; i < n; i++) memset(C.row(i), 0, (size_t)n * sizeof(u64)); // gemmTiled accumulates.
+        gemm::gemmTiled(gemm::rows(A.p, A.ld), gemm::rows(B.p, B.ld), C.p, C.ld, n, pool); // Leaf product.
+        return;                                                                 // Done.
+    }
+    int h = n / 2;                                                              // n is even above the leaves.
+    View A11 = A.quad(h, 0, 0), A12 = A.quad(h, 0, 1), A21 = A.quad(h, 1, 0), A22 = A.quad(h, 1, 1); // Blocks of A.
+    View B11 = B.quad(h, 0, 0), B12 = B.quad(h, 0, 1), B21 = B.quad(h, 1, 0), B22 = B.quad(h, 1, 1); // Blocks of B.
+    View C11 = C.quad(h, 0, 0), C12 = C.quad(h, 0, 1), C21 = C.quad(h, 1, 0), C22 = C.quad(h, 1, 1); // Blocks of C.
+    size_t m = arena.mark();                                                    // Free the temps on return.
+    View X = {arena.alloc((size_t)h * h), (size_t)h};                           // Left operand temp.
+    View Y = {arena.alloc((size_t)h * h), (size_t)h};                           // Right operand temp.
+    View Z = {arena.alloc((size_t)h * h), (size_t)h};                           // Holds P1 until the end.
+    sub(X, A11, A21, h, pool); sub(Y, B22, B12, h, pool);                       // S3, T3
+    winograd(C21, X, Y, h, leaf, arena, pool);                                  // C21 = P7 = S3 * T3
+    add(X, A21, A22, h, pool); sub(Y, B12, B11, h, pool);                       // S1, T1
+    winograd(C22, X, Y, h, leaf, arena, pool);                                  // C22 = P5 = S1 * T1
+    sub(X, X, A11, h, pool); sub(Y, B22, Y, h, pool);                           // S2 = S1 - A11, T2 = B22 - T1
+    winograd(C12, X, Y, h, leaf, arena, pool);                                  // C12 = P6 = S2 * T2
+    sub(X, A12, X, h, pool);                                                    // S4 = A12 - S2
+    winograd(C11, X, B22, h, leaf, arena, pool);                                // C11 = P3 = S4 * B22
+    winograd(Z, A11, B11, h, leaf, arena, pool);                                // Z = P1 = A11 * B11
+    add(C12, Z, C12, h, pool);                                                  // C12 = U2 = P1 + P6
+    add(C21, C12, C21, h, pool);                                                // C21 = U3 = U2 + P7
+    add(C12, C12, C22, h, pool);                                                // C12 = U4 = U2 + P5
+    add(C22, C21, C22, h, pool);                                                // C22 = U3 + P5 (final)
+    add(C12, C12, C11, h, pool);                                                // C12 = U4 + P3 (final)
+    sub(Y, Y, B21, h, pool);                                                    // T4 = T2 - B21
+    winograd(C11, A22, Y, h, leaf, arena, pool);                                // C11 = P4 = A22 * T4
+    sub(C21, C21, C11, h, pool);                                                // C21 = U3 - P4 (final)
+    winograd(C11, A12, B21, h, leaf, arena, pool);                              // C11 = P2 = A12 * B21
+    add(C11, C11, Z, h, pool);                                                  // C11 = P1 + P2 (final)
+    arena.release(m);                                                           // Give the temps back.
+}
+
+// Top level of winograd() with the 7 products as independent pool tasks.       //
+// All operand sums are formed first and three products get buffers of          //
+// their own (the other four land in C's quadrants), so this level needs        //
+// 11 half-size temps; each task then recurses serially in its own arena.       //
+static void winogradTasks(View C, View A, View B, int n, int leaf, int depth, Arena& arena, ThreadPool* pool) { // depth >= 1.
+    int h = n / 2;                                                              // n is even above the leaves.
+    size_t hh = (size_t)h * h;                                                  // Values in one half-size block.
+    View A11 = A.quad(h, 0, 0), A12 = A.quad(h, 0, 1), A21 = A.quad(h, 1, 0), A22 = A.quad(h, 1, 1); // Blocks of A.
+    View B11 = B.quad(h, 0, 0), B12 = B.quad(h, 0, 1), B21 = B.quad(h, 1, 0), B22 = B.quad(h, 1, 1); // Blocks of B.
+    View C11 = C.quad(h, 0, 0), C12 = C.quad(h, 0, 1), C21 = C.quad(h, 1, 0), C22 = C.quad(h, 1, 1); // Blocks of C.
+    size_t m = arena.mark();                                                    // Free the temps on return.
+    auto temp = [&] { return View{arena.alloc(hh), (size_t)h}; };               // One half-size block.
+    View S1 = temp(), S2 = temp(), S3 = temp(), S4 = temp();                    // Left operands.
+    View T1 = temp(), T2 = temp(), T3 = temp(), T4 = temp();                    // Right operands.
+    View P1 = temp(), P6 = temp(), P7 = temp();                                 // Products with no room in C.
+    add(S1, A21, A22, h, pool); sub(S2, S1, A11, h, pool);                      // S1, S2
+    sub(S3, A11, A21, h, pool); sub(S4, A12, S2, h, pool);                      // S3, S4
+    sub(T1, B12, B11, h, pool); sub(T2, B22, T1, h, pool);                      // T1, T2
+    sub(T3, B22, B12, h, pool); sub(T4, T2, B21, h, pool);                      // T3, T4
+    const View out[kTasks] = {P1, C11, C12, C21, C22, P6, P7};                  // P1, P2 .. P7
+    const View lhs[kTasks] = {A11, A12, S4, A22, S1, S2, S3};                   // ...
+    const View rhs[kTasks] = {B11, B21, B22, T4, T1, T2, T3};                   // ...
+    forEachTask(pool, kTasks, [&](int t) {                                      // Products are independent.
+        Arena own(hh + 64 * (size_t)depth);                                     // Temps below this level (< h^2).
+        winograd(out[t], lhs[t], rhs[t], h, leaf, own, nullptr);                // Pool tasks cannot nest.
+    });
+    add(C11, C11, P1, h, pool);                                                 // C11 = P1 + P2 (final)
+    add(P6, P1, P6, h, pool);                                                   // U2 = P1 + P6
+    add(P7, P6, P7, h, pool);                                                   // U3 = U2 + P7
+    add(C12, C12, P6, h, pool); add(C12, C12, C22, h, pool);                    // C12 = P3 + U2 + P5 (final)
+    add(C22, P7, C22, h, pool);                                                 // C22 = U3 + P5 (final)
+    sub(C21, P7, C21, h, pool);                                                 // C21 = U3 - P4 (final)
+    arena.release(m);                                                           // Give the temps back.
+}
+
+// Returns A * B computed with leaves of at most 'leaf' rows. When N needs      //
+// no padding, A and B are read in place (unless a row index reorders them)     //
+// and the result is written straight into C; otherwise padded copies are       //
+// made in the arena.                                                           //
+static Matrix multiply(const Matrix& A, const Matrix& B, int N, int leaf, ThreadPool* pool) { // Pads, recurses, unpads.
+    int depth = 0, m = N;                                                       // Find N <= m*2^depth with m <= leaf.
+    while (m > leaf) { m = (m + 1) / 2; depth++; }                              // Halve (rounding up) until small.
+    int P = m << depth;                                                         // Padded size (< N + 2^depth).
+    size_t words = (size_t)P * P;                                               // Values in one padded matrix.
+    auto inPlace = [&](const Matrix& M) { return P == N && M.rowsInOrder(); };  // Usable without a copy?
+    int copies = !inPlace(A) + !inPlace(B) + (P != N);                          // Padded copies needed.
+    bool tasks = pool && pool->size() > 1;                                      // Parallel top level?
+    size_t temps = tasks ? 11 * (words / 4) : words;                            // winogradTasks() or winograd().
+    Arena arena(copies * words + temps + 64 * (size_t)(depth + 1) + 64 * 11);   // Copies + temps.
+    auto operand = [&](const Matrix& M) -> View {                               // A or B as a PP view.
+        if (inPlace(M)) return {(u64*)M.row(0), M.stride()};                    // Only read by winograd().
+        View v = {arena.alloc(words), (size_t)P};                               // Padded copy.
+        for (int i = 0; i < P; i++) {                                           // Copy in, zero the padding.
+            u64* r = v.row(i);                                                  // Row i of the copy.
+            if (i < N) memcpy(r, M.row(i), (size_t)N * sizeof(u64));            // Honors the row permutation.
+            int from = i < N ? N : 0;                                           // First padding column.
+            memset(r + from, 0, (size_t)(P - from) * sizeof(u64));              // Zero padding.
+        }
+        return v;                                                               // ...
+    };
+    View a = operand(A), b = operand(B);                                        // Operands.
+    Matrix C(N);                                                                // Result.
+    View c = P == N ? View{(u64*)C.row(0), C.stride()}                          // Written directly,
+                    : View{arena.alloc(words), (size_t)P};                      // or padded first.
+    if (tasks) winogradTasks(c, a, b, P, leaf, depth - 1, arena, pool);         // The actual product.
+    else winograd(c, a, b, P, leaf, arena, pool);                               // ...
+    if (P != N)                                                                 // Unpad.
+        for (int i = 0; i < N; i++) memcpy(C.row(i), c.row(i), (size_t)N * sizeof(u64)); // Copy out.
+    return C;                                                                   // Exact product.
+}
+
+// Returns the leaf size s in {128, 256, 512} whose product is fastest at       //
+// kCalibrationSize, or INT_MAX if none beats the classic kernel by 5%.         //
+// Both sides use the pool, so the classic kernel's tile grid is compared       //
+// with the parallel top level of the Winograd product.                         //
+static int calibrate(ThreadPool* pool) {                                        // Called by prepare().
+    const int n = kCalibrationSize;                                             // 8 classic tiles.
+    Matrix X(n), Y(n);                                                          // Test operands.
+    u64 seed = 12345;                                                           // Fixed pseudo-random data.
+    for (int i = 0; i < n; i++)                                                 // Fill both matrices.
+        for (int j = 0; j < n; j++) {                                           // ...
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;      // LCG step.
+            X(i, j) = (long long)(seed >> 40);                                  // Some value.
+            Y(i, j) = (long long)(seed >> 20);                                  // Another value.
+        }
+    auto seconds = [](const function<void()>& f) {                              // Time taken by f().
+        auto t0 = chrono::steady_clock::now();                                  // Start.
+        f();                                                                    // Run it.
+        return chrono::duration<double>(chrono::steady_clock::now() - t0).count(); // Elapsed.
+    };
+    Matrix C(n);                                                                // Classic result (accumulates; unused).
+    double best = seconds([&] {                                                 // The classic kernel...
+        gemm::gemmTiled(gemm::rows(X), gemm::rows(Y), (u64*)C.row(0), C.stride(), n, pool); // ...
+    }) * 0.95;                                                                  // ...must lose by 5%.
+    int leaf = INT_MAX;                                                         // Classic so far.
+    for (int s = 128; s <= 512; s *= 2) {                                       // Candidate leaf sizes.
+        double t = seconds([&] { multiply(X, Y, n, s, pool); });                // log2(n/s) Winograd levels.
+        if (t < best) { best = t; leaf = s; }                                   // New winner.
+    }
+    return leaf;                                                                // ...
+}
+
+// Called after A and B are loaded, so the first multiply does not pay for      //
+// calibration. Without a configured cutoff it measures once, the first         //
+// time dense matrices of at least kCalibrationSize are loaded; smaller         //
+// products stay classic until then. With more than kTasks workers the          //
+// classic tile grid keeps them busier than the 7 parallel products can,        //
+// so the classic kernel is kept without measuring.                             //
+static void prepare(const Matrix& A, const Matrix& B, int N, ThreadPool* pool) { // Picks 'measured'.
+    if (cutoff >= 0 || calibrated || N < kCalibrationSize) return;              // Configured, done, or too small.
+    if (A.isSparse() || B.isSparse()) return;                                   // CSR products never use it.
+    calibrated = true;                                                          // Once per run.
+    if (pool && pool->size() > kTasks) return;                                  // Too many workers: classic.
+    OpTimer timer("calibrate");                                                 // For --stats.
+    measured = calibrate(pool);                                                 // Leaf size or INT_MAX.
+}
+
+// Leaf size to use for a product, or INT_MAX for the classic kernel.           //
+static int leafFor() { return cutoff >= 0 ? cutoff : measured; }                // Consulted by ::multiply().
+}  // namespace strassen
+
 // Returns the product C = A * B (size NN).                                    //
-Matrix multiply(const Matrix& A, const Matrix& B, int N) {                       // Function to multiply two matrices.
-    Matrix C(N, vector<long long>(N, 0));                                       // Prepare result matrix C filled with 0.
-    for (int i = 0; i < N; i++)                                                 // For each row of A.
-        for (int k = 0; k < N; k++)                                             // For each column index that pairs A and B.
-            for (int j = 0; j < N; j++)                                         // For each column of B.
-                C[i][j] += A[i][k] * B[k][j];                                   // Accumulate A[i][k] * B[k][j] into C[i][j].
+// Large products use Strassen-Winograd (see strassen::prepare).                //
+Matrix multiply(const Matrix& A, const Matrix& B, int N, ThreadPool* pool = nullptr) { // Function to multiply two matrices.
+    if (A.isSparse() || B.isSparse()) return sparse::multiply(A, B, N, pool);   // CSR kernels.
+    int leaf = strassen::leafFor();                                             // Leaf size, or INT_MAX.
+    if (N > leaf) return strassen::multiply(A, B, N, leaf, pool);               // Subcubic path.
+    Matrix C(N);                                                                // Prepare result matrix C filled with 0.
+    gemm::gemmTiled(gemm::rows(A), gemm::rows(B), (u64*)C.row(0), C.stride(), N, pool); // Fresh C: rows are in order.
     return C;                                                                   // Return the product.
 }
 
 // Computes the sum of the main diagonal (top-left to bottom-right).            //
 long long mainDiagonalSum(const Matrix& M, int N) {                              // Function to sum primary diagonal.
-    long long s = 0;                                                            // Accumulator for the sum.
-    for (int i = 0; i < N; i++) s += M[i][i];                                   // Add elements where row == col.
-    return s;                                                                   // Return the sum.
+    u64 s = 0;                                                                  // Accumulator for the sum (wraps).
+    for (int i = 0; i < N; i++) s += (u64)M.at(i, i);                           // Add elements where row == col.
+    return (long long)s;                                                        // Return the sum.
 }
 
 // Computes the sum of the secondary diagonal (top-right to bottom-left).       //
 long long secondaryDiagonalSum(const Matrix& M, int N) {                         // Function to sum secondary diagonal.
-    long long s = 0;                                                            // Accumulator for the sum.
-    for (int i = 0; i < N; i++) s += M[i][N - 1 - i];                           // Add elements where col = N-1-row.
-    return s;                                                                   // Return the sum.
+    u64 s = 0;                                                                  // Accumulator for the sum (wraps).
+    for (int i = 0; i < N; i++) s += (u64)M.at(i, N - 1 - i);                   // Add elements where col = N-1-row.
+    return (long long)s;                                                        // Return the sum.
 }
 
 // Swaps two rows r1 and r2 if both indices are within [0, N).                  //
 bool swapRows(Matrix& M, int N, int r1, int r2) {                                // Function to swap two rows.
     if (r1 < 0 || r2 < 0 || r1 >= N || r2 >= N) return false;                   // Validate indices are in range.
     if (r1 == r2) return true;                                                  // No-op if rows are the same.
-    swap(M[r1], M[r2]);                                                         // Swap the entire row vectors.
+    M.permuteRows(r1, r2);                                                      // O(1): swap entries of the row index.
+    M.touch();                                                                  // Contents changed.
     return true;                                                                // Signal success.
 }
 
 // Swaps two columns c1 and c2 if both indices are within [0, N).               //
-bool swapCols(Matrix& M, int N, int c1, int c2) {                                // Function to swap two columns.
+bool swapCols(Matrix& M, int N, int c1, int c2, ThreadPool* pool = nullptr) {    // Function to swap two columns.
     if (c1 < 0 || c2 < 0 || c1 >= N || c2 >= N) return false;                   // Validate indices are in range.
     if (c1 == c2) return true;                                                  // No-op if columns are the same.
-    for (int i = 0; i < N; i++) swap(M[i][c1], M[i][c2]);                       // Swap column elements in each row.
+    if (M.isSparse()) sparse::swapCols(M, N, c1, c2, pool);                     // Move entries within each row.
+    else for (int i = 0; i < N; i++) {                                          // Visit each row once.
+        long long* r = M.row(i);                                                // Row i of the matrix.
+        swap(r[c1], r[c2]);                                                     // Swap column elements in this row.
+    }
+    M.touch();                                                                  // Contents changed.
     return true;                                                                // Signal success.
 }
 
 // Updates one cell (r, c) to a new value if indices are valid.                 //
 bool updateCell(Matrix& M, int N, int r, int c, long long val) {                 // Function to update a single entry.
     if (r < 0 || c < 0 || r >= N || c >= N) return false;                       // Validate indices are in range.
-    M[r][c] = val;                                                              // Assign the new value.
+    M.set(r, c, val);                                                           // Assign the new value.
+    M.touch();                                                                  // Contents changed.
+    return true;                                                                // Signal success.
+}
+
+// Reorders all columns at once: new column j is old column order[j].           //
+// Used to apply many column swaps with a single pass over the matrix.          //
+bool permuteCols(Matrix& M, int N, const vector<int>& order, ThreadPool* pool = nullptr) { // Function to permute columns.
+    if ((int)order.size() != N) return false;                                   // Need one entry per column.
+    if (M.isSparse()) {                                                         // Relabel and re-sort each row.
+        sparse::permuteCols(M, N, order, pool);                                 // ...
+        M.touch();                                                              // Contents changed.
+        return true;                                                            // Signal success.
+    }
+    forEachRowRange(pool, N, [&](int i0, int i1) {                              // Rows are independent.
+        thread_local vector<long long> tmp;                                     // Copy of the row being permuted.
+        tmp.resize(N);                                                          // Big enough for one row.
+        for (int i = i0; i < i1; i++) {                                         // Each row in the range.
+            long long* r = M.row(i);                                            // Row i of the matrix.
+            memcpy(tmp.data(), r, (size_t)N * sizeof(long long));               // Save the old order.
+            for (int j = 0; j < N; j++) r[j] = tmp[order[j]];                   // Gather into the new order.
+        }
+    });
+    M.touch();                                                                  // Contents changed.
     return true;                                                                // Signal success.
 }
 
+// One pending cell assignment for updateCells().                               //
+struct CellUpdate {                                                             // (row, column, value) triple.
+    int r, c;                                                                   // Target cell.
+    long long val;                                                              // New value.
+};
+
+// Applies a group of cell updates in order (later ones win). Either all        //
+// indices are valid and every update is applied, or nothing changes.           //
+// A sparse matrix merges the whole group into its rows in one pass instead     //
+// of inserting the new entries one at a time.                                  //
+bool updateCells(Matrix& M, int N, const vector<CellUpdate>& ups) {             // Function to update many entries.
+    for (const CellUpdate& u : ups)                                             // Validate the whole group first.
+        if (u.r < 0 || u.c < 0 || u.r >= N || u.c >= N) return false;           // Reject it if any index is bad.
+    if (!M.isSparse()) {                                                        // Dense: plain assignments.
+        for (const CellUpdate& u : ups) M(u.r, u.c) = u.val;                    // Then assign every value.
+        M.touch();                                                              // Contents changed.
+        return true;                                                            // Signal success.
+    }
+    vector<int> ord(ups.size());                                                // Updates sorted by cell,
+    for (size_t k = 0; k < ord.size(); k++) ord[k] = (int)k;                    // ...
+    stable_sort(ord.begin(), ord.end(), [&](int x, int y) {                     // keeping their order per cell.
+        return ups[x].r != ups[y].r ? ups[x].r < ups[y].r : ups[x].c < ups[y].c; // ...
+    });
+    vector<int64_t> rowPtr(N + 1, 0);                                           // The merged matrix.
+    vector<int> cols;                                                           // ...
+    vector<long long> vals;                                                     // ...
+    cols.reserve(M.nnz() + ups.size());                                         // Upper bound on its size.
+    vals.reserve(M.nnz() + ups.size());                                         // ...
+    size_t u = 0;                                                               // Next update in 'ord'.
+    for (int i = 0; i < N; i++) {                                               // Rows in logical order.
+        const int* col = M.rowCols(i);                                          // Stored entries of row i.
+        const long long* val = M.rowVals(i);                                    // ...
+        int len = M.rowNnz(i), k = 0;                                           // ...
+        while (k < len || (u < ord.size() && ups[ord[u]].r == i)) {             // Merge entries and updates.
+            bool upd = u < ord.size() && ups[ord[u]].r == i && (k == len || ups[ord[u]].c <= col[k]); // Update first?
+            if (!upd) { cols.push_back(col[k]); vals.push_back(val[k++]); continue; } // Keep a stored entry.
+            const CellUpdate* last = &ups[ord[u++]];                            // Last update of this cell wins.
+            while (u < ord.size() && ups[ord[u]].r == i && ups[ord[u]].c == last->c) last = &ups[ord[u++]]; // ...
+            if (k < len && col[k] == last->c) k++;                              // Replaces the stored entry.
+            if (last->val != 0) { cols.push_back(last->c); vals.push_back(last->val); } // Zeros are dropped.
+        }
+        rowPtr[i + 1] = (int64_t)cols.size();                                   // End of row i.
+    }
+    M = Matrix::fromCsr(N, move(rowPtr), move(cols), move(vals));               // Rows now in logical order.
+    M.touch();                                                                  // Contents changed.
+    return true;                                                                // Signal success.
+}
+
+// Adds d to x with wraparound (the same bits the plain '+' would give).        //
+static inline void addWrap(long long& x, u64 d) { x = (long long)((u64)x + d); } // No signed-overflow UB.
+
+// Caches A + B, A * B and the diagonal sums of A and B, keyed on the           //
+// matrices' versions. Edits made through this class patch the cached           //
+// results instead of throwing them away:                                       //
+//   updateCell: A+B one cell, A*B one row or column (O(N)), diagonals O(1)     //
+//   swapRows/swapCols: A+B two rows/columns (O(N)); A*B a row or column        //
+//   swap (O(N)) or a rank-1 update (O(N^2)); diagonals O(1)                    //
+// Anything the cache did not see (e.g. a reload) changes a version, and the    //
+// affected result is recomputed in full the next time it is asked for.         //
+// Numeric patches of A+B and A*B need dense matrices; with a sparse A or B     //
+// only the row/column moves are patched and the rest is recomputed (the        //
+// sparse kernels are cheap). Rank-1 patches run at scalar speed while the      //
+// product uses the blocked kernels, so their total time since A*B was last     //
+// computed is capped at the time that computation took; past that, A*B is      //
+// left stale and recomputed only if it is asked for again.                     //
+class ResultCache {                                                             // Sits between main() and the matrices.
+public:                                                                         // Public interface.
+    ResultCache(Matrix& A, Matrix& B, int& N, ThreadPool* pool)                 // Refers to main()'s matrices.
+        : A_(A), B_(B), N_(N), pool_(pool) {}                                   // Nothing is cached yet.
+
+    const Matrix& sum() {                                                       // A + B.
+        OpTimer timer("add");                                                   // For --stats.
+        if (!fresh(sum_)) { sum_.m = add(A_, B_, N_, pool_); stamp(sum_); }     // Recompute only if stale.
+        return sum_.m;                                                          // Cached result.
+    }
+    const Matrix& product() {                                                   // A * B.
+        OpTimer timer("multiply");                                              // For --stats.
+        if (!fresh(prod_)) {                                                    // Recompute only if stale.
+            auto t0 = chrono::steady_clock::now();                              // Its cost sets the patch budget.
+            prod_.m = multiply(A_, B_, N_, pool_);                              // ...
+            stamp(prod_);                                                       // ...
+            prodSeconds_ = chrono::duration<double>(chrono::steady_clock::now() - t0).count(); // ...
+            patchSeconds_ = 0;                                                  // Nothing spent on patches yet.
+        }
+        return prod_.m;                                                         // Cached result.
+    }
+    long long mainDiagonal(int which) {                                         // Main diagonal sum of A (1) or B (2).
+        OpTimer timer("mainDiagonal");                                          // For --stats.
+        return diag(which).main;                                                // ...
+    }
+    long long secondaryDiagonal(int which) {                                    // Secondary diagonal sum.
+        OpTimer timer("secondaryDiagonal");                                     // For --stats.
+        return diag(which).sec;                                                 // ...
+    }
+
+    // Same contract as updateCell(), on A (which = 1) or B (which = 2).        //
+    bool updateCell(int which, int r, int c, long long val) {                   // Edit one cell and patch results.
+        OpTimer timer("updateCell");                                            // For --stats.
+        Matrix& M = mat(which);                                                 // Matrix being edited.
+        if (r < 0 || c < 0 || r >= N_ || c >= N_) return false;                 // Validate indices are in range.
+        bool sumOk = fresh(sum_) && dense(), prodOk = fresh(prod_) && dense();  // What is worth patching.
+        bool diagOk = fresh(which);                                             // ...
+        u64 delta = (u64)val - (u64)M.at(r, c);                                 // Change of this cell.
+        ::updateCell(M, N_, r, c, val);                                         // Apply the edit.
+        if (sumOk) { addWrap(sum_.m(r, c), delta); stamp(sum_); }               // One cell of A + B moves.
+        if (prodOk) {                                                           // A*B changes by delta * (row or column).
+            Matrix& P = prod_.m;                                                // Cached product.
+            if (which == 1) {                                                   // A(r,c) feeds row r of A*B,
+                long long* p = P.row(r);                                        // weighted by row c of B.
+                const long long* b = B_.row(c);                                 // ...
+                for (int j = 0; j < N_; j++) addWrap(p[j], delta * (u64)b[j]);  // O(N).
+            } else {                                                            // B(r,c) feeds column c of A*B,
+                for (int i = 0; i < N_; i++) addWrap(P(i, c), (u64)A_(i, r) * delta); // weighted by column r of A.
+            }
+            stamp(prod_);                                                       // Up to date again.
+        }
+        if (diagOk) {                                                           // Only diagonal cells matter.
+            Diag& d = diag_[which - 1];                                         // Sums for this matrix.
+            if (r == c) d.main += delta;                                        // On the main diagonal.
+            if (c == N_ - 1 - r) d.sec += delta;                                // On the secondary diagonal.
+            d.version = M.version();                                            // Up to date again.
+        }
+        return true;                                                            // Signal success.
+    }
+
+    // Applies a group of updates; same contract as updateCells().              //
+    bool updateCells(int which, const vector<CellUpdate>& ups) {                // Batch mode entry point.
+        OpTimer timer("updateCells");                                           // For --stats.
+        for (const CellUpdate& u : ups)                                         // Validate the whole group first.
+            if (u.r < 0 || u.c < 0 || u.r >= N_ || u.c >= N_) return false;     // Reject it if any index is bad.
+        if (!dense()) return ::updateCells(mat(which), N_, ups);                // One merge; results recomputed later.
+        for (const CellUpdate& u : ups) updateCell(which, u.r, u.c, u.val);     // Each one is an O(N) patch.
+        return true;                                                            // Signal success.
+    }
+
+    // Same contract as swapRows().                                             //
+    bool swapRows(int which, int r1, int r2) {                                  // Swap two rows and patch results.
+        OpTimer timer("swapRows");                                              // For --stats.
+        Matrix& M = mat(which);                                                 // Matrix being edited.
+        if (r1 < 0 || r2 < 0 || r1 >= N_ || r2 >= N_) return false;             // Validate indices are in range.
+        if (r1 == r2) return true;                                              // No-op if rows are the same.
+        bool sumOk = fresh(sum_) && dense(), diagOk = fresh(which);             // What is worth patching.
+        bool prodOk = fresh(prod_) && (which == 1 || rank1Ok());                // Row moves work for any storage.
+        if (diagOk) {                                                           // Four diagonal cells change.
+            Diag& d = diag_[which - 1];                                         // Sums for this matrix.
+            int s1 = N_ - 1 - r1, s2 = N_ - 1 - r2;                             // Secondary-diagonal columns.
+            d.main += (u64)M.at(r2, r1) - (u64)M.at(r1, r1) + (u64)M.at(r1, r2) - (u64)M.at(r2, r2); // New minus old.
+            d.sec += (u64)M.at(r2, s1) - (u64)M.at(r1, s1) + (u64)M.at(r1, s2) - (u64)M.at(r2, s2); // Same for secondary.
+        }
+        if (prodOk && which == 2) {                                             // Swapping rows of B:
+            vector<u64> u(N_), v(N_);                                           // A*B += u v^T with
+            for (int i = 0; i < N_; i++) u[i] = (u64)A_(i, r1) - (u64)A_(i, r2); // u = A[:,r1] - A[:,r2],
+            for (int j = 0; j < N_; j++) v[j] = (u64)B_(r2, j) - (u64)B_(r1, j); // v = B[r2,:] - B[r1,:].
+            rank1(prod_.m, u, v);                                               // O(N^2) instead of O(N^3).
+        }
+        ::swapRows(M, N_, r1, r2);                                              // Apply the edit.
+        if (sumOk) { recomputeSumRow(r1); recomputeSumRow(r2); stamp(sum_); }   // Two rows of A + B.
+        if (prodOk) {                                                           // Product is patched,
+            if (which == 1) prod_.m.permuteRows(r1, r2);                        // or its rows just swap (O(1)).
+            stamp(prod_);                                                       // Up to date again.
+        }
+        if (diagOk) diag_[which - 1].version = M.version();                     // Up to date again.
+        return true;                                                            // Signal success.
+    }
+
+    // Same contract as swapCols().                                             //
+    bool swapCols(int which, int c1, int c2) {                                  // Swap two columns and patch results.
+        OpTimer timer("swapCols");                                              // For --stats.
+        Matrix& M = mat(which);                                                 // Matrix being edited.
+        if (c1 < 0 || c2 < 0 || c1 >= N_ || c2 >= N_) return false;             // Validate indices are in range.
+        if (c1 == c2) return true;                                              // No-op if columns are the same.
+        bool sumOk = fresh(sum_) && dense(), diagOk = fresh(which);             // What is worth patching.
+        bool prodOk = fresh(prod_) && (which == 2 || rank1Ok());                // Column moves work for any storage.
+        if (diagOk) {                                                           // Four diagonal cells change.
+            Diag& d = diag_[which - 1];                                         // Sums for this matrix.
+            int i1 = N_ - 1 - c1, i2 = N_ - 1 - c2;                             // Secondary-diagonal rows.
+            d.main += (u64)M.at(c1, c2) - (u64)M.at(c1, c1) + (u64)M.at(c2, c1) - (u64)M.at(c2, c2); // New minus old.
+            d.sec += (u64)M.at(i1, c2) - (u64)M.at(i1, c1) + (u64)M.at(i2, c1) - (u64)M.at(i2, c2); // Same for secondary.
+        }
+        if (prodOk && which == 1) {                                             // Swapping columns of A:
+            vector<u64> u(N_), v(N_);                                           // A*B += u v^T with
+            for (int i = 0; i < N_; i++) u[i] = (u64)A_(i, c2) - (u64)A_(i, c1); // u = A[:,c2] - A[:,c1],
+            for (int j = 0; j < N_; j++) v[j] = (u64)B_(c1, j) - (u64)B_(c2, j); // v = B[c1,:] - B[c2,:].
+            rank1(prod_.m, u, v);                                               // O(N^2) instead of O(N^3).
+        }
+        ::swapCols(M, N_, c1, c2, pool_);                                       // Apply the edit.
+        if (sumOk) { recomputeSumCol(c1); recomputeSumCol(c2); stamp(sum_); }   // Two columns of A + B.
+        if (prodOk) {                                                           // Product is patched,
+            if (which == 2) ::swapCols(prod_.m, N_, c1, c2, pool_);             // or its columns just swap (O(N)).
+            stamp(prod_);                                                       // Up to date again.
+        }
+        if (diagOk) diag_[which - 1].version = M.version();                     // Up to date again.
+        return true;                                                            // Signal success.
+    }
+
+    // Same contract as permuteCols(). Only a cached product of a permuted B    //
+    // can follow along cheaply; other results are recomputed when needed.      //
+    bool permuteCols(int which, const vector<int>& order) {                     // Many column swaps at once.
+        OpTimer timer("permuteCols");                                           // For --stats.
+        bool prodOk = fresh(prod_);                                             // Worth patching?
+        if (!::permuteCols(mat(which), N_, order, pool_)) return false;         // Apply the edit.
+        if (prodOk && which == 2) {                                             // (A*B)Q = A(BQ):
+            ::permuteCols(prod_.m, N_, order, pool_);                           // permute the product the same way.
+            stamp(prod_);                                                       // Up to date again.
+        }
+        return true;                                                            // Signal success.
+    }
+
+    // True if swapCols(which, ...) would keep a cached A * B up to date.       //
+    bool patchesColSwap(int which) const { return fresh(prod_) && (which == 2 || rank1Ok()); } // For runBatch().
+
+private:                                                                        // Cache state.
+    struct Cached {                                                             // One cached result.
+        Matrix m;                                                               // The result itself.
+        u64 verA = 0, verB = 0;                                                 // Versions it was computed from.
+    };
+    struct Diag {                                                               // Cached diagonal sums.
+        u64 version = 0;                                                        // Matrix version they belong to.
+        u64 main = 0, sec = 0;                                                  // Sums, with wraparound.
+    };
+
+    Matrix& mat(int which) { return which == 1 ? A_ : B_; }                     // 1 = A, 2 = B.
+    bool dense() const { return !A_.isSparse() && !B_.isSparse(); }             // Numeric patches allowed?
+    bool fresh(const Cached& c) const {                                         // Computed from the current A and B?
+        return c.verA == A_.version() && c.verB == B_.version();                // Versions are never reused.
+    }
+    bool fresh(int which) { return diag_[which - 1].version == mat(which).version(); } // Diagonal sums current?
+    void stamp(Cached& c) { c.verA = A_.version(); c.verB = B_.version(); }     // Mark as current.
+
+    const Diag& diag(int which) {                                               // Sums for A or B, refreshed if stale.
+        Diag& d = diag_[which - 1];                                             // Cached sums.
+        if (!fresh(which)) {                                                    // Recompute in O(N).
+            const Matrix& M = mat(which);                                       // Matrix to sum.
+            d.main = (u64)mainDiagonalSum(M, N_);                               // Main diagonal.
+            d.sec = (u64)secondaryDiagonalSum(M, N_);                           // Secondary diagonal.
+            d.version = M.version();                                            // Now current.
+        }
+        return d;                                                               // Up-to-date sums.
+    }
+
+    void recomputeSumRow(int i) {                                               // Row i of A + B from scratch.
+        const long long* a = A_.row(i);                                         // Row i of A.
+        const long long* b = B_.row(i);                                         // Row i of B.
+        long long* s = sum_.m.row(i);                                           // Row i of the sum.
+        for (int j = 0; j < N_; j++) s[j] = (long long)((u64)a[j] + (u64)b[j]); // O(N).
+    }
+    void recomputeSumCol(int j) {                                               // Column j of A + B from scratch.
+        for (int i = 0; i < N_; i++)                                            // O(N).
+            sum_.m(i, j) = (long long)((u64)A_(i, j) + (u64)B_(i, j));          // One cell per row.
+    }
+
+    bool rank1Ok() const { return dense() && patchSeconds_ < prodSeconds_; }    // Patch budget left?
+    void rank1(Matrix& P, const vector<u64>& u, const vector<u64>& v) {         // P += u v^T.
+        auto t0 = chrono::steady_clock::now();                                  // Charged to the budget.
+        forEachRowRange(pool_, N_, [&](int i0, int i1) {                        // Rows are independent.
+            for (int i = i0; i < i1; i++) {                                     // Each row in the range.
+                if (u[i] == 0) continue;                                        // Row unchanged.
+                long long* p = P.row(i);                                        // Row i of P.
+                for (int j = 0; j < N_; j++) addWrap(p[j], u[i] * v[j]);        // Add u[i] * v.
+            }
+        });
+        patchSeconds_ += chrono::duration<double>(chrono::steady_clock::now() - t0).count(); // ...
+    }
+
+    Matrix& A_;                                                                 // main()'s matrix A.
+    Matrix& B_;                                                                 // main()'s matrix B.
+    int& N_;                                                                    // main()'s dimension (changes on reload).
+    ThreadPool* pool_;                                                          // Used for full recomputes.
+    Cached sum_, prod_;                                                         // A + B and A * B.
+    double prodSeconds_ = 0, patchSeconds_ = 0;                                 // Last product vs. patches since.
+    Diag diag_[2];                                                              // Diagonal sums of A and B.
+};
+
 // Parses a base-10 integer from a string line into 'out', with bounds checks.  //
 static bool parseInt(const string& s, int& out) {                                // Helper to parse int from string.
     istringstream iss(s);                                                        // Create a string stream for parsing.
@@ -119,15 +1934,321 @@ static bool parseInt(const string& s, int& out) {
     return true;                                                                 // Parsing succeeded.
 }
 
+// ---- Batch mode --------------------------------------------------------------//
+// A batch script has one command per line, either as text                      //
+//     swapRows A 0 3                                                           //
+// or as a JSON object                                                          //
+//     {"op": "swapRows", "matrix": "A", "args": [0, 3]}                        //
+// Commands: add, multiply, diag M, print M, swapRows M i j, swapCols M i j,    //
+// updateCell M r c value, reload. Blank lines and '#' comments are skipped.    //
+struct BatchCommand {                                                           // One parsed script line.
+    string op;                                                                  // Command name.
+    int which = 0;                                                              // 1 = A, 2 = B, 0 = none.
+    vector<long long> args;                                                     // Integer arguments.
+    int line = 0;                                                               // Script line (for messages).
+};
+
+// Splits one JSON object line into the words of the equivalent text command.   //
+// Only the flat shape documented above is understood.                          //
+static bool jsonToWords(const string& s, vector<string>& words) {               // Minimal JSON reader.
+    size_t p = 0;                                                               // Parse position.
+    auto skipWs = [&] { while (p < s.size() && isspace((unsigned char)s[p])) ++p; }; // Skip whitespace.
+    auto readString = [&](string& out) {                                        // Reads "..." into out.
+        if (p >= s.size() || s[p] != '"') return false;                         // Must start with a quote.
+        for (++p; p < s.size() && s[p] != '"'; ++p) {                           // Until the closing quote.
+            if (s[p] == '\\' && p + 1 < s.size()) ++p;                          // Keep the escaped character.
+            out += s[p];                                                        // Collect it.
+        }
+        if (p >= s.size()) return false;                                        // Unterminated string.
+        ++p;                                                                    // Skip the closing quote.
+        return true;                                                            // Done.
+    };
+    auto readNumber = [&](string& out) {                                        // Reads an integer literal.
+        size_t q = p;                                                           // Start of the literal.
+        if (q < s.size() && s[q] == '-') ++q;                                   // Optional sign.
+        while (q < s.size() && isdigit((unsigned char)s[q])) ++q;               // Digits.
+        if (q == p) return false;                                               // Nothing numeric here.
+        out = s.substr(p, q - p);                                               // Keep the text as-is.
+        p = q;                                                                  // Continue after it.
+        return true;                                                            // Done.
+    };
+    string op, matrix;                                                          // Fields we care about.
+    vector<string> args;                                                        // Contents of "args".
+    skipWs();                                                                   // Leading whitespace.
+    if (p >= s.size() || s[p++] != '{') return false;                           // Must be an object.
+    skipWs();                                                                   // Before the first key.
+    if (p < s.size() && s[p] == '}') return false;                              // {} has no "op".
+    while (true) {                                                              // One "key": value pair per pass.
+        string key;                                                             // Field name.
+        skipWs();                                                               // Before the key.
+        if (!readString(key)) return false;                                     // Keys are strings.
+        skipWs();                                                               // Before the colon.
+        if (p >= s.size() || s[p++] != ':') return false;                       // Separator.
+        skipWs();                                                               // Before the value.
+        if (key == "args") {                                                    // Array of integers.
+            if (p >= s.size() || s[p++] != '[') return false;                   // Must be an array.
+            skipWs();                                                           // Before the first element.
+            while (p < s.size() && s[p] != ']') {                               // Until the closing bracket.
+                string num;                                                     // One element.
+                if (!readNumber(num)) return false;                             // Only integers allowed.
+                args.push_back(num);                                            // Keep it.
+                skipWs();                                                       // After the element.
+                if (p < s.size() && s[p] == ',') { ++p; skipWs(); }             // Next element.
+            }
+            if (p >= s.size()) return false;                                    // Unterminated array.
+            ++p;                                                                // Skip ']'.
+        } else {                                                                // "op", "matrix" or unknown keys.
+            string value;                                                       // Field value.
+            if (!(readString(value) || readNumber(value))) return false;        // Strings or numbers only.
+            if (key == "op") op = value;                                        // Command name.
+            else if (key == "matrix") matrix = value;                           // "A" or "B".
+        }
+        skipWs();                                                               // After the value.
+        if (p < s.size() && s[p] == ',') { ++p; continue; }                     // Another pair follows.
+        if (p < s.size() && s[p] == '}') break;                                 // End of the object.
+        return false;                                                           // Anything else is malformed.
+    }
+    ++p;                                                                        // Skip '}'.
+    skipWs();                                                                   // Trailing whitespace is fine,
+    if (p < s.size()) return false;                                             // anything else is not.
+    if (op.empty()) return false;                                               // "op" is required.
+    words.push_back(op);                                                        // Same order as the text form:
+    if (!matrix.empty()) words.push_back(matrix);                               // op, matrix, arguments.
+    words.insert(words.end(), args.begin(), args.end());                        // ...
+    return true;                                                                // Converted.
+}
+
+enum class LineKind { Empty, Command, Invalid };                                // Result of parsing one script line.
+
+// Parses one script line (text or JSON) into cmd.                              //
+static LineKind parseBatchLine(const string& line, BatchCommand& cmd) {         // Shared by both syntaxes.
+    size_t p = 0;                                                               // First visible character,
+    while (p < line.size() && isspace((unsigned char)line[p])) ++p;             // using the same set as '>>' (\v, \f too).
+    if (p == line.size() || line[p] == '#') return LineKind::Empty;             // Blank line or comment.
+    vector<string> words;                                                       // Command split into words.
+    if (line[p] == '{') {                                                       // JSON object.
+        if (!jsonToWords(line, words)) return LineKind::Invalid;                // Malformed JSON.
+    } else {                                                                    // Plain text.
+        istringstream ws(line);                                                 // Whitespace-separated words.
+        for (string w; ws >> w;) words.push_back(w);                            // Collect them.
+    }
+    static const struct { const char* name; bool matrix; int args; } kinds[] = { // Shape of every command.
+        {"add", false, 0}, {"multiply", false, 0}, {"reload", false, 0},        // Whole-pair operations.
+        {"diag", true, 0}, {"print", true, 0},                                  // Read one matrix.
+        {"swapRows", true, 2}, {"swapCols", true, 2}, {"updateCell", true, 3},  // Edit one matrix.
+    };
+    for (const auto& k : kinds) {                                               // Find the command.
+        if (words[0] != k.name) continue;                                       // Not this one.
+        size_t expected = 1 + (k.matrix ? 1 : 0) + k.args;                      // Words the command needs.
+        if (words.size() != expected) return LineKind::Invalid;                 // Wrong number of arguments.
+        cmd.op = words[0];                                                      // Command name.
+        if (k.matrix) {                                                         // Which matrix it works on.
+            if (words[1] == "A") cmd.which = 1;                                 // Matrix A.
+            else if (words[1] == "B") cmd.which = 2;                            // Matrix B.
+            else return LineKind::Invalid;                                      // Neither.
+        }
+        for (size_t i = k.matrix ? 2 : 1; i < words.size(); i++) {              // Integer arguments.
+            istringstream num(words[i]);                                        // Parse like the menu does.
+            long long v;                                                        // Parsed value.
+            if (!(num >> v) || !num.eof()) return LineKind::Invalid;            // Must be a whole integer.
+            cmd.args.push_back(v);                                              // Keep it.
+        }
+        return LineKind::Command;                                               // Recognized.
+    }
+    return LineKind::Invalid;                                                   // Unknown command name.
+}
+
+// Executes a batch script against A and B. Consecutive swaps and updates of    //
+// the same matrix are collected into a run and applied together: row swaps     //
+// only touch the row index, column swaps are folded into one permutation       //
+// applied in a single pass, and updates go through updateCells() as a group.   //
+// Column swaps on A are applied one at a time instead for as long as the       //
+// cache keeps patching a cached A * B (see ResultCache); the rest of the       //
+// run is folded into a permutation.                                            //
+// Only requested results (add, multiply, diag, print) and errors are printed.  //
+int runBatch(istream& in, const string& filename, Matrix& A, Matrix& B, int& N, // Returns the exit code.
+             ThreadPool& pool, ResultWriter& results, ResultCache& cache) {     // Same pool, writer and cache as the menu.
+    bool failed = false;                                                        // Any error makes the exit code 1.
+    vector<BatchCommand> run;                                                   // Pending swaps/updates of one kind.
+    auto inRange = [&](long long x) { return x >= 0 && x < N; };                // Valid row/column index?
+    auto outOfBounds = [&](const BatchCommand& c) {                             // Reports a rejected command.
+        cout << "Line " << c.line << ": Out of bounds.\n";                      // Same wording as the menu.
+        failed = true;                                                          // Remember for the exit code.
+    };
+    auto flush = [&] {                                                          // Applies the pending run.
+        if (run.empty()) return;                                                // Nothing pending.
+        int which = run[0].which;                                               // Every command targets this matrix.
+        if (run[0].op == "swapRows") {                                          // Row swaps are O(1) each.
+            for (const BatchCommand& c : run)                                   // In script order.
+                if (!inRange(c.args[0]) || !inRange(c.args[1])) outOfBounds(c); // Skip bad ones.
+                else cache.swapRows(which, (int)c.args[0], (int)c.args[1]);     // Edits the row index only.
+        } else if (run[0].op == "swapCols") {                                   // Fold into one permutation.
+            vector<const BatchCommand*> ok;                                     // Valid swaps, in order.
+            for (const BatchCommand& c : run)                                   // Check each one.
+                if (!inRange(c.args[0]) || !inRange(c.args[1])) outOfBounds(c); // Skip bad ones.
+                else ok.push_back(&c);                                          // Keep good ones.
+            size_t k = 0;                                                       // Swaps applied so far.
+            while (k < ok.size() && (k + 1 == ok.size() || (which == 1 && cache.patchesColSwap(which)))) { // Lone swap,
+                cache.swapCols(which, (int)ok[k]->args[0], (int)ok[k]->args[1]); // or A * B still patched.
+                k++;                                                            // ...
+            }
+            if (k < ok.size()) {                                                // The rest:
+                vector<int> order(N);                                           // Current column j = old order[j].
+                for (int j = 0; j < N; j++) order[j] = j;                       // Start from the identity.
+                for (; k < ok.size(); k++) swap(order[ok[k]->args[0]], order[ok[k]->args[1]]); // O(1) per swap.
+                cache.permuteCols(which, order);                                // One pass over the matrix.
+            }
+        } else {                                                                // updateCell run.
+            vector<CellUpdate> ups;                                             // Valid updates, in order.
+            for (const BatchCommand& c : run)                                   // Check each one.
+                if (!inRange(c.args[0]) || !inRange(c.args[1])) outOfBounds(c); // Skip bad ones.
+                else ups.push_back({(int)c.args[0], (int)c.args[1], c.args[2]}); // Keep good ones.
+            cache.updateCells(which, ups);                                      // Apply them as one group.
+        }
+        run.clear();                                                            // Run is done.
+    };
+
+    string line;                                                                // Current script line.
+    int lineNo = 0;                                                             // Its number, from 1.
+    while (getline(in, line)) {                                                 // Stream the script.
+        lineNo++;                                                               // Count lines for messages.
+        BatchCommand cmd;                                                       // Parsed form.
+        LineKind kind = parseBatchLine(line, cmd);                              // Text or JSON.
+        if (kind == LineKind::Empty) continue;                                  // Nothing to do.
+        if (kind == LineKind::Invalid) {                                        // Unknown or malformed.
+            cout << "Line " << lineNo << ": Invalid command.\n";                // Report and keep going.
+            failed = true;                                                      // Remember for the exit code.
+            continue;                                                           // Next line.
+        }
+        cmd.line = lineNo;                                                      // For later messages.
+        if (cmd.op == "swapRows" || cmd.op == "swapCols" || cmd.op == "updateCell") { // Batchable edits.
+            if (!run.empty() && (run[0].op != cmd.op || run[0].which != cmd.which)) flush(); // Kind changed.
+            run.push_back(cmd);                                                 // Extend the run.
+            continue;                                                           // Apply later.
+        }
+        flush();                                                                // Reads must see all edits.
+        const Matrix& M = cmd.which == 2 ? B : A;                               // Target of diag/print.
+        if (cmd.op == "add") {                                                  // A + B.
+            results.write(cache.sum(), "A + B:");                               // Compute (or reuse) and report.
+        } else if (cmd.op == "multiply") {                                      // A * B.
+            results.write(cache.product(), "A * B:");                           // Compute (or patch) and report.
+        } else if (cmd.op == "diag") {                                          // Diagonal sums.
+            cout << "Main: " << cache.mainDiagonal(cmd.which) << "\n";          // Main diagonal, O(1) if cached.
+            cout << "Secondary: " << cache.secondaryDiagonal(cmd.which) << "\n"; // Secondary diagonal.
+        } else if (cmd.op == "print") {                                         // Show a matrix.
+            results.write(M, cmd.which == 1 ? "Matrix A:" : "Matrix B:");       // Through the output mode.
+        } else if (cmd.op == "reload") {                                        // Re-read the input file.
+            if (!loadMatrices(filename, A, B, N, &pool)) {                      // Keeps the old data on failure.
+                cout << "Reload failed.\n";                                     // Report the failure.
+                failed = true;                                                  // Remember for the exit code.
+            } else {                                                            // New data,
+                strassen::prepare(A, B, N, &pool);                              // maybe a larger N.
+            }
+        }
+    }
+    flush();                                                                    // Apply a trailing run.
+    return failed ? 1 : 0;                                                      // Exit code.
+}
+
+#ifndef MATRIX_OPS_NO_MAIN
+// bench.cpp includes this file with MATRIX_OPS_NO_MAIN defined to reuse        //
+// everything above without a second main() and its helpers.                    //
+
+// Reads the integer setting 'key = value' from a config file, if present.      //
+static bool readConfigInt(const string& path, const string& key, int& out) {    // Lines starting with '#' are comments.
+    ifstream cfg(path);                                                         // A missing file just means "not set".
+    string line;                                                                // Current line.
+    while (getline(cfg, line)) {                                                // Scan every line.
+        size_t eq = line.find('=');                                             // key = value separator.
+        if (eq == string::npos || line.compare(0, 1, "#") == 0) continue;       // Not a setting.
+        istringstream ks(line.substr(0, eq));                                   // Key, without spaces.
+        string k;                                                               // ...
+        if (ks >> k && k == key) return parseInt(line.substr(eq + 1), out);     // Found it.
+    }
+    return false;                                                               // Not set.
+}
+
 // Entry point of the program.                                                  //
 int main(int argc, char** argv) {                                               // main function with argc/argv.
     ios::sync_with_stdio(false);                                                // Speed up I/O by unsyncing with C I/O.
     cin.tie(nullptr);                                                           // Disable tie to avoid flushing on input.
 
     string filename;                                                            // Holds the path to the input file.
-    if (argc >= 2) {                                                            // If a filename was provided on command line,
-        filename = argv[1];                                                     // use it directly.
-    } else {                                                                    // Otherwise, ask the user interactively.
+    int threads = (int)thread::hardware_concurrency();                          // Default: one thread per core.
+    bool deterministic = false;                                                 // Fixed task schedule when set.
+    string saveBin;                                                             // --save-bin target, if any.
+    OutputFormat format = OutputFormat::Text;                                   // How printed matrices are emitted.
+    string outPath;                                                             // --out file for csv/bin output.
+    string batchPath;                                                           // --batch script ("-" = stdin).
+    int strassenCutoff = -1;                                                    // --strassen-cutoff; -1 = not given.
+    bool stats = false;                                                         // --stats: time every operation.
+    for (int i = 1; i < argc; i++) {                                            // Scan command-line arguments.
+        string arg = argv[i];                                                   // Current argument.
+        if (arg == "--threads") {                                               // --threads N
+            if (i + 1 >= argc || !parseInt(argv[++i], threads) || threads <= 0) { // Needs a positive count.
+                cout << "Invalid thread count.\n";                              // Report the bad value.
+                return 1;                                                       // Exit with error.
+            }
+        } else if (arg == "--deterministic") {                                  // --deterministic
+            deterministic = true;                                               // Disable work stealing.
+        } else if (arg == "--save-bin") {                                       // --save-bin FILE
+            if (i + 1 >= argc) {                                                // Needs a filename.
+                cout << "Missing file for --save-bin.\n";                       // Report the problem.
+                return 1;                                                       // Exit with error.
+            }
+            saveBin = argv[++i];                                                // Where to write A and B.
+        } else if (arg == "--quiet") {                                          // --quiet
+            format = OutputFormat::None;                                        // Skip printing matrices.
+        } else if (arg.rfind("--output=", 0) == 0) {                            // --output=text|csv|bin
+            string f = arg.substr(9);                                           // Text after '='.
+            if (f == "text") format = OutputFormat::Text;                       // Pretty-printed (default).
+            else if (f == "csv") format = OutputFormat::Csv;                    // CSV file.
+            else if (f == "bin") format = OutputFormat::Binary;                 // Binary containers.
+            else {                                                              // Unknown format.
+                cout << "Unknown output format '" << f << "'.\n";               // Name it.
+                return 1;                                                       // Exit with error.
+            }
+        } else if (arg == "--out") {                                            // --out FILE
+            if (i + 1 >= argc) {                                                // Needs a filename.
+                cout << "Missing file for --out.\n";                            // Report the problem.
+                return 1;                                                       // Exit with error.
+            }
+            outPath = argv[++i];                                                // Destination for csv/bin.
+        } else if (arg == "--strassen-cutoff") {                                // --strassen-cutoff N (0 = off)
+            if (i + 1 >= argc || !parseInt(argv[++i], strassenCutoff) || strassenCutoff < 0) { // Needs N >= 0.
+                cout << "Invalid Strassen cutoff.\n";                           // Report the bad value.
+                return 1;                                                       // Exit with error.
+            }
+        } else if (arg == "--stats") {                                          // --stats
+            stats = true;                                                       // Report timings on stderr.
+        } else if (arg == "--batch") {                                          // --batch FILE
+            if (i + 1 >= argc) {                                                // Needs a script.
+                cout << "Missing file for --batch.\n";                          // Report the problem.
+                return 1;                                                       // Exit with error.
+            }
+            batchPath = argv[++i];                                              // Script to run instead of the menu.
+        } else if (filename.empty()) {                                          // First plain argument,
+            filename = arg;                                                     // is the input file.
+        } else {                                                                // Anything else is a mistake.
+            cout << "Unknown argument '" << arg << "'.\n";                      // Name the offending argument.
+            return 1;                                                           // Exit with error.
+        }
+    }
+    if (threads <= 0) threads = 1;                                              // hardware_concurrency() may report 0.
+    if (strassenCutoff < 0 && !readConfigInt("matrix_ops.cfg", "strassen_cutoff", strassenCutoff)) // Config file,
+        strassenCutoff = -1;                                                    // else calibrate after loading.
+    if (strassenCutoff >= 0) strassen::cutoff = strassenCutoff > 0 ? strassenCutoff : INT_MAX; // 0 disables it.
+    if (stats) {                                                                // Before the pool starts its threads,
+        opStats.enabled = true;                                                 // so inherited counters include them.
+        cerr.tie(nullptr);                                                      // Don't flush half-printed stdout lines.
+        if (!opStats.counters.open()) cerr << "[stats] hardware counters unavailable; showing wall time only.\n"; // ...
+    }
+
+    if (filename.empty() && batchPath == "-") {                                 // stdin carries the script,
+        cout << "No filename.\n";                                               // so it cannot carry the name.
+        return 1;                                                               // Exit with error.
+    }
+    if (filename.empty()) {                                                     // No filename on the command line,
         cout << "Enter input filename: ";                                       // Prompt the user for a filename.
         if (!getline(cin, filename) || filename.empty()) {                      // Read a full line; require non-empty.
             cout << "No filename.\n";                                           // Inform missing filename.
@@ -135,16 +2256,45 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (outPath.empty())                                                        // Default output file names.
+        outPath = format == OutputFormat::Binary ? "results.bin" : "results.csv"; // Only used by csv/bin.
+    ResultWriter results;                                                       // Receives every printed matrix.
+    if (!results.open(format, outPath)) {                                       // Create the output file if needed.
+        cout << "Error writing file.\n";                                        // Report the failure.
+        return 1;                                                               // Exit with error.
+    }
+    ThreadPool pool(threads);                                                   // Worker threads live for the whole run.
+    pool.setDeterministic(deterministic);                                       // Apply --deterministic.
+
     Matrix A, B;                                                                // Matrices A and B to operate on.
     int N = 0;                                                                  // Dimension of the square matrices.
-    if (!loadMatrices(filename, A, B, N)) return 1;                             // Load matrices; exit if it fails.
+    ResultCache cache(A, B, N, &pool);                                          // Cached results, patched on edits.
+    if (!loadMatrices(filename, A, B, N, &pool)) return 1;                      // Load matrices; exit if it fails.
+    strassen::prepare(A, B, N, &pool);                                          // Calibrate now, not in multiply.
+    if (!saveBin.empty()) {                                                     // Convert to the binary format?
+        const Matrix* both[2] = {&A, &B};                                       // Save A then B.
+        if (!saveBinary(saveBin, both, 2)) {                                    // Write the container.
+            cout << "Error writing file.\n";                                    // Report the failure.
+            return 1;                                                           // Exit with error.
+        }
+        cout << "Saved binary to '" << saveBin << "'.\n";                       // Confirm the conversion.
+    }
+    if (!batchPath.empty()) {                                                   // Non-interactive mode.
+        if (batchPath == "-") return runBatch(cin, filename, A, B, N, pool, results, cache); // Script on stdin.
+        ifstream script(batchPath);                                             // Script in a file.
+        if (!script) {                                                          // Could not open it.
+            cout << "Error opening file.\n";                                    // Same message as for input.
+            return 1;                                                           // Exit with error.
+        }
+        return runBatch(script, filename, A, B, N, pool, results, cache);       // Run it and exit.
+    }
 
     cin.clear();                                                                // Clear any stream error flags.
     cin.ignore(numeric_limits<streamsize>::max(), '\n');                        // Discard leftover characters on the line.
 
     cout << "Loaded from '" << filename << "'.\n";                              // Confirm successful load.
-    printMatrix(A, "Matrix A:");                                                // Print matrix A.
-    printMatrix(B, "Matrix B:");                                                // Print matrix B.
+    results.write(A, "Matrix A:");                                              // Print matrix A.
+    results.write(B, "Matrix B:");                                              // Print matrix B.
 
     while (true) {                                                              // Interactive loop for operations.
         cout << "\n1) Add (A+B)\n"                                              // Show menu option 1: addition.
@@ -175,11 +2325,11 @@ int main(int argc, char** argv) {
         }
 
         if (op == 1) {                                                          // Menu option 1: A + B.
-            Matrix C = add(A, B, N);                                            // Compute the sum matrix.
-            printMatrix(C, "A + B:");                                           // Print the result.
+            const Matrix& C = cache.sum();                                      // Compute (or reuse) the sum matrix.
+            results.write(C, "A + B:");                                         // Print the result.
         } else if (op == 2) {                                                   // Menu option 2: A * B.
-            Matrix C = multiply(A, B, N);                                       // Compute the product matrix.
-            printMatrix(C, "A * B:");                                           // Print the result.
+            const Matrix& C = cache.product();                                  // Compute (or patch) the product matrix.
+            results.write(C, "A * B:");                                         // Print the result.
         } else if (op == 3) {                                                   // Menu option 3: Diagonal sums.
             cout << "Choose matrix (1=A, 2=B): ";                               // Ask which matrix to use.
             string wline; if (!getline(cin, wline)) break;                      // Read the choice line.
@@ -188,11 +2338,11 @@ int main(int argc, char** argv) {
                 continue;                                                       // Return to menu.
             }
             if (w == 1) {                                                       // If A selected,
-                cout << "Main: " << mainDiagonalSum(A, N) << "\n";              // Print main diagonal sum of A.
-                cout << "Secondary: " << secondaryDiagonalSum(A, N) << "\n";    // Print secondary diagonal sum of A.
+                cout << "Main: " << cache.mainDiagonal(1) << "\n";              // Print main diagonal sum of A.
+                cout << "Secondary: " << cache.secondaryDiagonal(1) << "\n";    // Print secondary diagonal sum of A.
             } else if (w == 2) {                                                // If B selected,
-                cout << "Main: " << mainDiagonalSum(B, N) << "\n";              // Print main diagonal sum of B.
-                cout << "Secondary: " << secondaryDiagonalSum(B, N) << "\n";    // Print secondary diagonal sum of B.
+                cout << "Main: " << cache.mainDiagonal(2) << "\n";              // Print main diagonal sum of B.
+                cout << "Secondary: " << cache.secondaryDiagonal(2) << "\n";    // Print secondary diagonal sum of B.
             } else {                                                            // Otherwise, invalid matrix choice.
                 cout << "Invalid.\n";                                           // Inform invalid selection.
             }
@@ -211,11 +2361,11 @@ int main(int argc, char** argv) {
                 cout << "Invalid input.\n";                                     // If failed, report error.
                 continue;                                                       // Return to menu.
             }
-            bool ok = (w == 1) ? swapRows(A, N, r1, r2)                         // Perform swap on A if chosen.
-                               : (w == 2) ? swapRows(B, N, r1, r2)              // Or on B if chosen.
+            bool ok = (w == 1) ? cache.swapRows(1, r1, r2)                      // Perform swap on A if chosen.
+                               : (w == 2) ? cache.swapRows(2, r1, r2)           // Or on B if chosen.
                                           : false;                              // Invalid matrix selection.
             if (!ok) cout << "Out of bounds.\n";                                // Report invalid indices.
-            else printMatrix(w == 1 ? A : B, "After row swap:");                // Print updated matrix.
+            else results.write(w == 1 ? A : B, "After row swap:");              // Print updated matrix.
         } else if (op == 5) {                                                   // Menu option 5: Swap columns.
             cout << "Choose matrix (1=A, 2=B): ";                               // Ask which matrix to modify.
             string wline; if (!getline(cin, wline)) break;                      // Read the line.
@@ -231,11 +2381,11 @@ int main(int argc, char** argv) {
                 cout << "Invalid input.\n";                                     // If failed, report error.
                 continue;                                                       // Return to menu.
             }
-            bool ok = (w == 1) ? swapCols(A, N, c1, c2)                         // Perform swap on A if chosen.
-                               : (w == 2) ? swapCols(B, N, c1, c2)              // Or on B if chosen.
+            bool ok = (w == 1) ? cache.swapCols(1, c1, c2)                      // Perform swap on A if chosen.
+                               : (w == 2) ? cache.swapCols(2, c1, c2)           // Or on B if chosen.
                                           : false;                              // Invalid matrix selection.
             if (!ok) cout << "Out of bounds.\n";                                // Report invalid indices.
-            else printMatrix(w == 1 ? A : B, "After col swap:");                // Print updated matrix.
+            else results.write(w == 1 ? A : B, "After col swap:");              // Print updated matrix.
         } else if (op == 6) {                                                   // Menu option 6: Update a cell.
             cout << "Choose matrix (1=A, 2=B): ";                               // Ask which matrix to modify.
             string wline; if (!getline(cin, wline)) break;                      // Read the line.
@@ -251,16 +2401,17 @@ int main(int argc, char** argv) {
                 cout << "Invalid input.\n";                                     // Report parsing error.
                 continue;                                                       // Return to menu.
             }
-            bool ok = (w == 1) ? updateCell(A, N, r, c, v)                      // Update A if chosen.
-                               : (w == 2) ? updateCell(B, N, r, c, v)           // Or update B if chosen.
+            bool ok = (w == 1) ? cache.updateCell(1, r, c, v)                   // Update A if chosen.
+                               : (w == 2) ? cache.updateCell(2, r, c, v)        // Or update B if chosen.
                                           : false;                              // Invalid matrix selection.
             if (!ok) cout << "Out of bounds.\n";                                // Report invalid indices.
-            else printMatrix(w == 1 ? A : B, "After update:");                  // Print updated matrix.
+            else results.write(w == 1 ? A : B, "After update:");                // Print updated matrix.
         } else if (op == 7) {                                                   // Menu option 7: Reload from file.
-            if (loadMatrices(filename, A, B, N)) {                              // Try to reload matrices from file.
+            if (loadMatrices(filename, A, B, N, &pool)) {                       // Try to reload matrices from file.
+                strassen::prepare(A, B, N, &pool);                              // Maybe a larger N.
                 cout << "Reloaded.\n";                                          // Confirm reload.
-                printMatrix(A, "Matrix A:");                                    // Print A again.
-                printMatrix(B, "Matrix B:");                                    // Print B again.
+                results.write(A, "Matrix A:");                                  // Print A again.
+                results.write(B, "Matrix B:");                                  // Print B again.
             } else {                                                            // If reload failed,
                 cout << "Reload failed.\n";                                     // report the failure.
             }
@@ -270,3 +2421,4 @@ int main(int argc, char** argv) {
     }
     return 0;                                                                   // Return success status.
 }
+#endif